@@ -51,7 +51,68 @@
 
 #ifdef TextureMapping
 typedef int Texture[1024][1024];
-struct TextureSet { Texture texture, normalmap, lightmap, lightmap_diffuseonly; };
+/* Mip levels 1.. of a texture are halved in size, down to 1x1, and follow
+ * each other in one array. Each is indexed [u][v] like the texture itself.
+ */
+#define MipLevels 11
+// MipOffset: Where mip level 1..MipLevels-1 starts. MipOffset(MipLevels) is the size of the chain.
+#define MipOffset(level) ((1024*1024 - (1024 >> ((level)-1)) * (1024 >> ((level)-1))) / 3)
+/* The texture file holds each texture, its mip levels and its normal map once.
+ * Surfaces refer to them by index, and only their lightmaps are their own.
+ */
+struct TextureImage { Texture texture, normalmap; int mipmaps[MipOffset(MipLevels)]; };
+enum { FloorTexture, CeilTexture, WallTexture, WallTexture2, NumTextures };
+struct SurfaceRecord // a surface in the texture file
+{
+    unsigned texture;
+    unsigned hash;  // what the lightmap was baked from
+    unsigned round; // bake rounds done: 0 = none, 1 = diffuse light, 2.. = radiosity
+};
+  #ifdef LightMapping
+/* Lightmaps are packed into shared atlas pages. The lightmap of a surface
+ * has LightmapTexelsPerUnit texels per map unit, up to the size of a page.
+ */
+#define LightmapPageSize      1024
+#define LightmapTexelsPerUnit 32
+typedef int LightmapPage[LightmapPageSize][LightmapPageSize];
+struct LightmapRect { unsigned short page, x, y, w, h; };
+// Lightmap: The texel (tx,ty) of a surface's lightmap, in the lightmap's own resolution.
+#define Lightmap(pages, set, tx,ty) (pages)[(set)->lightmap.page][(set)->lightmap.x + (tx)][(set)->lightmap.y + (ty)]
+// LightmapAt: The lightmap texel at texture coordinates (u,v), which are 0-1023.
+#define LightmapAt(set, u,v) Lightmap(lightmap_pages, set, (u) * (set)->lightmap.w / 1024, (v) * (set)->lightmap.h / 1024)
+
+/* The renderer reads the lightmaps from a copy that is packed into blocks of
+ * 4x4 texels: two RGB565 colors, and a 2-bit index for each texel that picks
+ * one of them or a blend of them. That is 4 bits per texel instead of 32;
+ * the full pages are only touched when something is baked.
+ */
+#define LightmapBlockSize 4
+struct LightmapBlock { unsigned short color0, color1; unsigned indices; };
+typedef struct LightmapBlock PackedLightmapPage[LightmapPageSize/LightmapBlockSize][LightmapPageSize/LightmapBlockSize];
+
+/* The bake works on tiles of TileSize*TileSize lightmap texels,
+ * and keeps track of each tile in the texture file.
+ */
+#define TileSize 32
+#define TilesAlong(n) (((n) + TileSize-1) / TileSize)
+struct TileRecord
+{
+    unsigned round; // bake rounds done, as in SurfaceRecord
+    float change;   // average change of its texels in the last round it was baked; <0 = queued
+};
+// TileAt: The tile that holds the lightmap texel (tx,ty) of a surface.
+#define TileAt(set, tx,ty) (set)->tiles[(tx) / TileSize * TilesAlong((set)->lightmap.h) + (ty) / TileSize]
+  #endif
+struct TextureSet
+{
+    const int (*texture)[1024], (*normalmap)[1024]; // in the texture file
+    const int* mips[MipLevels];                     // texture, and its mip levels
+  #ifdef LightMapping
+    struct LightmapRect lightmap;
+    struct SurfaceRecord* record; // bake state; walls keep it in the upper texture's
+    struct TileRecord* tiles;     // likewise, by x and then y
+  #endif
+};
 #endif
 
 /* Sectors: Floor and ceiling height; list of wall vertexes and neighbors */
@@ -68,6 +129,11 @@ static struct sector
     struct TextureSet *floortexture, *ceiltexture, *uppertextures, *lowertextures;
 #endif
 } *sectors = NULL;
+#if defined(TextureMapping) && defined(LightMapping)
+static LightmapPage *lightmap_pages = NULL, *diffuse_pages = NULL; // diffuse_pages: without radiosity
+static PackedLightmapPage *packed_pages = NULL;                     // lightmap_pages, for the renderer
+static unsigned NumLightmapPages = 0;
+#endif
 static unsigned NumSectors = 0;
 
 #ifdef VisibilityTracking
@@ -205,6 +271,111 @@ static int IntersectLineSegments(float x0,float y0, float x1,float y1,
         && abs(PointSide(x0,y0, x2,y2,x3,y3) + PointSide(x1,y1, x2,y2,x3,y3)) != 2;
 }
 
+#if defined(TextureMapping) && defined(LightMapping)
+/* Ray casting mostly looks for the edges of a sector that a ray crosses. So
+ * once the map is verified, each sector gets its bounding box, the heights of
+ * the holes behind its edges, and a tree of bounding boxes over its edges.
+ * The tree splits the edges by index, so a search returns the candidate edges
+ * in the same order as a plain loop over the edges would visit them.
+ */
+#define EdgeLeafSize 4 // edges in a tree leaf
+
+static struct SectorAccel
+{
+    struct xy bounding_min, bounding_max;
+    float *hole_low, *hole_high;    // per edge; 9e9 and -9e9 if there's no neighbor
+    struct xy *node_min, *node_max; // implicit binary tree, node 1 covers all edges
+} *sector_accel = NULL;
+
+static void GetSectorBoundingBox(int sectorno, struct xy* bounding_min, struct xy* bounding_max)
+{
+    const struct sector* sect = &sectors[sectorno];
+    for(int s = 0; s < sect->npoints; ++s)
+    {
+        bounding_min->x = min(bounding_min->x, sect->vertex[s].x);
+        bounding_min->y = min(bounding_min->y, sect->vertex[s].y);
+        bounding_max->x = max(bounding_max->x, sect->vertex[s].x);
+        bounding_max->y = max(bounding_max->y, sect->vertex[s].y);
+    }
+}
+
+static void BuildEdgeTree(struct SectorAccel* acc, const struct sector* sect, unsigned node, unsigned begin, unsigned end)
+{
+    struct xy bmin = {1e9f, 1e9f}, bmax = {-1e9f, -1e9f};
+    for(unsigned s = begin; s < end; ++s)
+    {
+        bmin.x = min(bmin.x, min(sect->vertex[s].x, sect->vertex[s+1].x));
+        bmin.y = min(bmin.y, min(sect->vertex[s].y, sect->vertex[s+1].y));
+        bmax.x = max(bmax.x, max(sect->vertex[s].x, sect->vertex[s+1].x));
+        bmax.y = max(bmax.y, max(sect->vertex[s].y, sect->vertex[s+1].y));
+    }
+    acc->node_min[node] = bmin;
+    acc->node_max[node] = bmax;
+    if(end - begin <= EdgeLeafSize) return;
+
+    unsigned middle = (begin + end) / 2;
+    BuildEdgeTree(acc, sect, node*2,   begin, middle);
+    BuildEdgeTree(acc, sect, node*2+1, middle, end);
+}
+
+static void BuildSectorAccel(void)
+{
+    sector_accel = calloc(NumSectors, sizeof(*sector_accel));
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        const struct sector* sect = &sectors[n];
+        struct SectorAccel* acc = &sector_accel[n];
+
+        acc->bounding_min = (struct xy) {1e9f, 1e9f};
+        acc->bounding_max = (struct xy) {-1e9f, -1e9f};
+        GetSectorBoundingBox(n, &acc->bounding_min, &acc->bounding_max);
+
+        acc->hole_low  = malloc(sect->npoints * sizeof(*acc->hole_low));
+        acc->hole_high = malloc(sect->npoints * sizeof(*acc->hole_high));
+        for(unsigned s = 0; s < sect->npoints; ++s)
+        {
+            float hole_low = 9e9, hole_high = -9e9;
+            if(sect->neighbors[s] >= 0)
+            {
+                hole_low  = max( sect->floor, sectors[sect->neighbors[s]].floor );
+                hole_high = min( sect->ceil,  sectors[sect->neighbors[s]].ceil  );
+            }
+            acc->hole_low[s]  = hole_low;
+            acc->hole_high[s] = hole_high;
+        }
+
+        acc->node_min = malloc((sect->npoints*4 + 2) * sizeof(*acc->node_min));
+        acc->node_max = malloc((sect->npoints*4 + 2) * sizeof(*acc->node_max));
+        BuildEdgeTree(acc, sect, 1, 0, sect->npoints);
+    }
+}
+static void UnloadSectorAccel(void)
+{
+    for(unsigned n = 0; n < NumSectors; ++n)
+        free(sector_accel[n].hole_low),  free(sector_accel[n].hole_high),
+        free(sector_accel[n].node_min),  free(sector_accel[n].node_max);
+    free(sector_accel);
+    sector_accel = NULL;
+}
+
+// FindEdgeCandidates: Collect, in edge order, the edges whose bounding box overlaps that of segment (x0,y0)-(x1,y1).
+static unsigned FindEdgeCandidates(const struct SectorAccel* acc, unsigned node, unsigned begin, unsigned end,
+                                   float x0,float y0, float x1,float y1,
+                                   unsigned short* result, unsigned count)
+{
+    if(!IntersectBox(x0,y0, x1,y1, acc->node_min[node].x,acc->node_min[node].y, acc->node_max[node].x,acc->node_max[node].y))
+        return count;
+    if(end - begin <= EdgeLeafSize)
+    {
+        for(unsigned s = begin; s < end; ++s) result[count++] = s;
+        return count;
+    }
+    unsigned middle = (begin + end) / 2;
+    count = FindEdgeCandidates(acc, node*2,   begin, middle, x0,y0, x1,y1, result, count);
+    return  FindEdgeCandidates(acc, node*2+1, middle, end,   x0,y0, x1,y1, result, count);
+}
+#endif
+
 struct Scaler { int result, bop, fd, ca, cache; };
 
 #define Scaler_Init(a,b,c,d,f) \
@@ -224,20 +395,140 @@ static int Scaler_Next(struct Scaler* i)
 # include <fcntl.h>
 # include <sys/stat.h>
 # include <errno.h>
+  #ifdef LightMapping
+#  define STB_RECT_PACK_IMPLEMENTATION
+#  include "imstb_rectpack.h"
+
+// Scaler_Skip: Step over n values at once, ending up exactly where n calls to Scaler_Next() would.
+// (Scaler_Init() with a later starting point rounds differently.)
+static void Scaler_Skip(struct Scaler* i, unsigned n)
+{
+    long long total = i->cache + (long long)n * i->fd, steps = total >= i->ca ? total / i->ca : 0;
+    i->cache   = total - steps * i->ca;
+    i->result += steps * i->bop;
+}
 
-static int LoadTexture(void)
+// LightmapSize: The number of lightmap texels along a surface of this length, in whole blocks.
+static unsigned short LightmapSize(float length)
 {
-    int initialized = 0;
+    int size = clamp((int)ceilf(length * LightmapTexelsPerUnit), LightmapBlockSize, LightmapPageSize);
+    return (size + LightmapBlockSize-1) / LightmapBlockSize * LightmapBlockSize;
+}
+
+/* PackLightmaps: Size the lightmap of every surface by its area, and pack them
+ * into as few atlas pages as they fit in. The upper and lower textures of a wall
+ * share one lightmap, as they cover different heights of it. rects[] receives
+ * the lightmaps in the order the texture sets are in the file. As every size is
+ * in whole blocks, so is every position.
+ * Returns the number of pages.
+ */
+static unsigned PackLightmaps(struct LightmapRect* rects)
+{
+    unsigned nsurfaces = 0;
+    for(unsigned n=0; n<NumSectors; ++n) nsurfaces += 2 + sectors[n].npoints;
+    stbrp_rect* pack  = malloc(nsurfaces * sizeof(*pack));
+    stbrp_node* nodes = malloc(LightmapPageSize * sizeof(*nodes));
+
+    unsigned nsets = 0, npack = 0;
+    for(unsigned n=0; n<NumSectors; ++n)
+    {
+        const struct sector* sect = &sectors[n];
+        const struct SectorAccel* acc = &sector_accel[n];
+        unsigned short w = LightmapSize(acc->bounding_max.x - acc->bounding_min.x);
+        unsigned short h = LightmapSize(acc->bounding_max.y - acc->bounding_min.y);
+        pack[npack++] = (stbrp_rect) { .id = nsets++, .w = w, .h = h }; // floor
+        pack[npack++] = (stbrp_rect) { .id = nsets++, .w = w, .h = h }; // ceiling
+        for(unsigned s=0; s<sect->npoints; ++s)
+        {
+            float dx = sect->vertex[s+1].x - sect->vertex[s].x, dy = sect->vertex[s+1].y - sect->vertex[s].y;
+            pack[npack++] = (stbrp_rect) { .id = nsets + s, .w = LightmapSize(sqrtf(dx*dx + dy*dy)),
+                                                             .h = LightmapSize(sect->ceil - sect->floor) };
+        }
+        nsets += sect->npoints * 2;
+    }
+
+    unsigned npages = 0;
+    for(unsigned remain = nsurfaces; remain > 0; ++npages)
+    {
+        stbrp_context context;
+        stbrp_init_target(&context, LightmapPageSize, LightmapPageSize, nodes, LightmapPageSize);
+        stbrp_pack_rects(&context, pack, remain);
+        // Whatever did not fit, goes to the next page.
+        unsigned kept = 0;
+        for(unsigned k=0; k<remain; ++k)
+            if(pack[k].was_packed)
+                rects[pack[k].id] = (struct LightmapRect) { npages, pack[k].x, pack[k].y, pack[k].w, pack[k].h };
+            else
+                pack[kept++] = pack[k];
+        remain = kept;
+    }
+
+    // The lower texture of each wall shares the lightmap of the upper texture.
+    for(unsigned n=0, set=0; n<NumSectors; ++n)
+    {
+        set += 2;
+        for(unsigned s=0; s<sectors[n].npoints; ++s)
+            rects[set + sectors[n].npoints + s] = rects[set + s];
+        set += sectors[n].npoints * 2;
+    }
+
+    free(nodes);
+    free(pack);
+    return npages;
+}
+  #endif
+
+// BuildMipmaps: Make each mip level of a texture by averaging 2x2 texels of the level above it.
+static void BuildMipmaps(const int (*texture)[1024], int* mipmaps)
+{
+    const int* above = &texture[0][0];
+    for(unsigned level=1; level<MipLevels; ++level)
+    {
+        unsigned size = 1024 >> level;
+        int* mip = mipmaps + MipOffset(level);
+        for(unsigned u=0; u<size; ++u)
+            for(unsigned v=0; v<size; ++v)
+            {
+                const int* p = &above[(u*2+0) * size*2 + v*2], *q = &above[(u*2+1) * size*2 + v*2];
+                int r = (((p[0] >> 16) & 0xFF) + ((p[1] >> 16) & 0xFF) + ((q[0] >> 16) & 0xFF) + ((q[1] >> 16) & 0xFF) + 2) / 4;
+                int g = (((p[0] >>  8) & 0xFF) + ((p[1] >>  8) & 0xFF) + ((q[0] >>  8) & 0xFF) + ((q[1] >>  8) & 0xFF) + 2) / 4;
+                int b = (((p[0] >>  0) & 0xFF) + ((p[1] >>  0) & 0xFF) + ((q[0] >>  0) & 0xFF) + ((q[1] >>  0) & 0xFF) + 2) / 4;
+                mip[u*size + v] = r*65536 + g*256 + b;
+            }
+        above = mip;
+    }
+}
+
+static void LoadTexture(void)
+{
+    static const char* const texture_files[NumTextures][2] =
+        { [FloorTexture] = { "floor2.ppm", "floor2_norm.ppm" },
+          [CeilTexture]  = { "ceil2.ppm",  "ceil2_norm.ppm"  },
+          [WallTexture]  = { "wall2.ppm",  "wall2_norm.ppm"  },
+          [WallTexture2] = { "wall3.ppm",  "wall3_norm.ppm"  } };
+
+    unsigned nsets = 0;
+    for(unsigned n=0; n<NumSectors; ++n) nsets += 2 + sectors[n].npoints * 2;
+  #ifdef LightMapping
+    struct LightmapRect* rects = malloc(nsets * sizeof(*rects));
+    NumLightmapPages = PackLightmaps(rects);
+    off_t lightmapsize = sizeof(LightmapPage) * 2 * (off_t)NumLightmapPages; // with and without radiosity
+    off_t packedsize   = sizeof(PackedLightmapPage) * (off_t)NumLightmapPages;
+    unsigned ntiles = 0;
+    for(unsigned set=0; set<nsets; ++set) ntiles += TilesAlong(rects[set].w) * TilesAlong(rects[set].h);
+    off_t tilesize = sizeof(struct TileRecord) * (off_t)ntiles;
+  #else
+    off_t lightmapsize = 0, packedsize = 0, tilesize = 0;
+  #endif
     int fd = open("portrend_textures.bin", O_RDWR | O_CREAT, 0644);
     if(lseek(fd, 0, SEEK_END) == 0)
     {
 InitializeTextures:;
         // Initialize by loading textures
-        #define LoadTexture(filename, name) \
-            Texture* name = NULL; do { \
+        #define LoadTexture(filename, name) do { \
                 FILE* fp = fopen(filename, "rb"); \
+                memset(name, 0, sizeof(*name)); \
                 if(!fp) perror(filename); else { \
-                    name = malloc(sizeof(*name)); \
                     fseek(fp, 0x11, SEEK_SET); \
                     for(unsigned y=0; y<1024; ++y) \
                         for(unsigned x=0; x<1024; ++x) \
@@ -248,16 +539,6 @@ InitializeTextures:;
                     fclose(fp); } \
             } while(0)
 
-        #define UnloadTexture(name) free(name)
-
-        Texture dummylightmap;
-        memset(&dummylightmap, 0, sizeof(dummylightmap));
-
-        LoadTexture("wall2.ppm", WallTexture);   LoadTexture("wall2_norm.ppm", WallNormal);
-        LoadTexture("wall3.ppm", WallTexture2);  LoadTexture("wall3_norm.ppm", WallNormal2);
-        LoadTexture("floor2.ppm", FloorTexture); LoadTexture("floor2_norm.ppm", FloorNormal);
-        LoadTexture("ceil2.ppm", CeilTexture);   LoadTexture("ceil2_norm.ppm", CeilNormal);
-
         #define SafeWrite(fd, buf, amount) do { \
                 const char* source = (const char*)(buf); \
                 long remain = (amount); \
@@ -269,35 +550,39 @@ InitializeTextures:;
                 } \
                 if(remain > 0) perror("write"); \
             } while(0)
-        #define PutTextureSet(txtname, normname) do { \
-            SafeWrite(fd, txtname,       sizeof(Texture)); \
-            SafeWrite(fd, normname,      sizeof(Texture)); \
-            SafeWrite(fd, &dummylightmap, sizeof(Texture)); \
-            SafeWrite(fd, &dummylightmap, sizeof(Texture)); } while(0)
+        #define PutSurface(index) do { \
+            struct SurfaceRecord record = { .texture = index }; \
+            SafeWrite(fd, &record, sizeof(record)); } while(0)
 
         printf("Initializing textures... ");
         lseek(fd, 0, SEEK_SET);
-        for(unsigned n=0; n<NumSectors; ++n)
+        Texture* image = malloc(sizeof(*image));
+        static int mipmaps[MipOffset(MipLevels)];
+        for(unsigned t=0; t<NumTextures; ++t)
         {
-            for(int s=printf("%d/%d", n+1,NumSectors); s--; ) putchar('\b');
+            for(int s=printf("%d/%d", t+1,NumTextures); s--; ) putchar('\b');
             fflush(stdout);
 
-            PutTextureSet(FloorTexture, FloorNormal);
-            PutTextureSet(CeilTexture,  CeilNormal);
-            for(unsigned w=0; w<sectors[n].npoints; ++w) PutTextureSet(WallTexture, WallNormal);
-            for(unsigned w=0; w<sectors[n].npoints; ++w) PutTextureSet(WallTexture2, WallNormal2);
+            LoadTexture(texture_files[t][0], image); SafeWrite(fd, image, sizeof(Texture));
+            BuildMipmaps(*image, mipmaps);
+            LoadTexture(texture_files[t][1], image); SafeWrite(fd, image, sizeof(Texture));
+            SafeWrite(fd, mipmaps, sizeof(mipmaps));
         }
-        ftruncate(fd, lseek(fd, 0, SEEK_CUR));
-        printf("\n"); fflush(stdout);
+        free(image);
 
-        UnloadTexture(WallTexture);  UnloadTexture(WallNormal);
-        UnloadTexture(WallTexture2); UnloadTexture(WallNormal2);
-        UnloadTexture(FloorTexture); UnloadTexture(FloorNormal);
-        UnloadTexture(CeilTexture);  UnloadTexture(CeilNormal);
+        for(unsigned n=0; n<NumSectors; ++n)
+        {
+            PutSurface(FloorTexture);
+            PutSurface(CeilTexture);
+            for(unsigned w=0; w<sectors[n].npoints; ++w) PutSurface(WallTexture);
+            for(unsigned w=0; w<sectors[n].npoints; ++w) PutSurface(WallTexture2);
+        }
+        // The tiles start out not baked, and the lightmap pages black.
+        ftruncate(fd, lseek(fd, 0, SEEK_CUR) + tilesize + packedsize + lightmapsize);
+        printf("\n"); fflush(stdout);
 
-        #undef UnloadTexture
+        #undef PutSurface
         #undef LoadTexture
-        initialized = 1;
     }
     off_t filesize = lseek(fd, 0, SEEK_END);
     char* texturedata = mmap(NULL, filesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
@@ -305,14 +590,14 @@ InitializeTextures:;
 
     printf("Loading textures\n");
     off_t pos = 0;
-    for(unsigned n=0; n<NumSectors; ++n)
-    {
-        sectors[n].floortexture = (void*) (texturedata + pos); pos += sizeof(struct TextureSet);
-        sectors[n].ceiltexture  = (void*) (texturedata + pos); pos += sizeof(struct TextureSet);
-        unsigned w = sectors[n].npoints;
-        sectors[n].uppertextures = (void*) (texturedata + pos); pos += sizeof(struct TextureSet) * w;
-        sectors[n].lowertextures = (void*) (texturedata + pos); pos += sizeof(struct TextureSet) * w;
-    }
+    const struct TextureImage* images = (void*) (texturedata + pos); pos += sizeof(*images) * NumTextures;
+    struct SurfaceRecord* records = (void*) (texturedata + pos); pos += sizeof(*records) * nsets;
+  #ifdef LightMapping
+    struct TileRecord* tiles = (void*) (texturedata + pos); pos += tilesize;
+    packed_pages   = (void*) (texturedata + pos); pos += packedsize;
+    lightmap_pages = (void*) (texturedata + pos); pos += lightmapsize / 2;
+    diffuse_pages  = (void*) (texturedata + pos); pos += lightmapsize / 2;
+  #endif
     printf("done, %llu bytes mmapped out of %llu\n", (unsigned long long)pos, (unsigned long long) filesize);
     if(pos != filesize)
     {
@@ -320,7 +605,35 @@ InitializeTextures:;
         munmap(texturedata, filesize);
         goto InitializeTextures;
     }
-    return initialized;
+
+    static struct TextureSet* texturesets = NULL;
+    texturesets = realloc(texturesets, nsets * sizeof(*texturesets));
+    for(unsigned set=0; set<nsets; ++set)
+    {
+        const struct TextureImage* image = &images[records[set].texture % NumTextures];
+        texturesets[set] = (struct TextureSet) { .texture = image->texture, .normalmap = image->normalmap,
+                                                 .mips = { &image->texture[0][0] } };
+        for(unsigned level=1; level<MipLevels; ++level)
+            texturesets[set].mips[level] = image->mipmaps + MipOffset(level);
+  #ifdef LightMapping
+        texturesets[set].lightmap = rects[set];
+        texturesets[set].record   = &records[set];
+        texturesets[set].tiles    = tiles;
+        tiles += TilesAlong(rects[set].w) * TilesAlong(rects[set].h);
+  #endif
+    }
+    for(unsigned n=0, set=0; n<NumSectors; ++n)
+    {
+        unsigned w = sectors[n].npoints;
+        sectors[n].floortexture  = &texturesets[set]; set += 1;
+        sectors[n].ceiltexture   = &texturesets[set]; set += 1;
+        sectors[n].uppertextures = &texturesets[set]; set += w;
+        sectors[n].lowertextures = &texturesets[set]; set += w;
+    }
+  #ifdef LightMapping
+    free(rects);
+    fprintf(stderr, "%u lightmap pages of %ux%u texels.\n", NumLightmapPages, LightmapPageSize, LightmapPageSize);
+  #endif
 }
 
 #ifdef LightMapping
@@ -391,6 +704,43 @@ static void AddColor(int* target, struct xyz color)
     *target = ClampWithDesaturation(r, g, b);
 }
 
+// Expand565: An RGB565 color in 8 bits per channel.
+static int Expand565(unsigned color)
+{
+    int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+// Blend3: Two thirds of color c0 and one third of color c1.
+static int Blend3(int c0, int c1)
+{
+    int r = (((c0 >> 16) & 0xFF) * 2 + ((c1 >> 16) & 0xFF)) / 3;
+    int g = (((c0 >>  8) & 0xFF) * 2 + ((c1 >>  8) & 0xFF)) / 3;
+    int b = (((c0 >>  0) & 0xFF) * 2 + ((c1 >>  0) & 0xFF)) / 3;
+    return r*65536 + g*256 + b;
+}
+// BlockPalette: The four colors that the indexes of a lightmap block pick from.
+static void BlockPalette(const struct LightmapBlock* block, int palette[4])
+{
+    palette[0] = Expand565(block->color0);
+    palette[1] = Expand565(block->color1);
+    palette[2] = Blend3(palette[0], palette[1]);
+    palette[3] = Blend3(palette[1], palette[0]);
+}
+/* LightmapSample: The lightmap texel at texture coordinates (u,v), which are 0-1023,
+ * from the packed lightmap. Neighbouring pixels mostly land in the same block,
+ * so the palette of the last block is kept.
+ */
+static int LightmapSample(const struct TextureSet* set, unsigned u, unsigned v)
+{
+    static const struct LightmapBlock* last = NULL;
+    static int palette[4];
+    unsigned x = set->lightmap.x + u * set->lightmap.w / 1024;
+    unsigned y = set->lightmap.y + v * set->lightmap.h / 1024;
+    const struct LightmapBlock* block = &packed_pages[set->lightmap.page][x / LightmapBlockSize][y / LightmapBlockSize];
+    if(block != last) { BlockPalette(block, palette); last = block; }
+    return palette[(block->indices >> 2*(x % LightmapBlockSize * LightmapBlockSize + y % LightmapBlockSize)) & 3];
+}
+
 static struct xyz PerturbNormal(struct xyz normal,
                                 struct xyz tangent,
                                 struct xyz bitangent,
@@ -405,32 +755,160 @@ static struct xyz PerturbNormal(struct xyz normal,
                           normal.z * perturb.z + bitangent.z * perturb.y + tangent.z * perturb.x };
 }
 
-static void GetSectorBoundingBox(int sectorno, struct xy* bounding_min, struct xy* bounding_max)
+#if defined(__AVX__)
+# include <immintrin.h>
+#elif defined(__SSE__)
+# include <xmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+// NeonMask: The sign bits of the four lanes as a bitmask, like _mm_movemask_ps.
+static inline int NeonMask(float32x4_t v)
 {
-    const struct sector* sect = &sectors[sectorno];
-    for(int s = 0; s < sect->npoints; ++s)
+    static const int32_t lanes[4] = {0,1,2,3};
+    return vaddvq_u32(vshlq_u32(vshrq_n_u32(vreinterpretq_u32_f32(v), 31), vld1q_s32(lanes)));
+}
+#endif
+
+/* Shadow rays and radiosity rays are traced in packets of up to PacketSize
+ * rays. The rays of a packet that are in the same sector are tested against
+ * that sector's edges all at once, eight at a time with AVX or four at a time
+ * with SSE or NEON. The rest of the work, following each ray through a portal
+ * or finding what it hit, is done one ray at a time by StepRay.
+ */
+#define PacketSize 8
+
+struct RayPacket
+{
+    float ox[PacketSize], oz[PacketSize]; // origins
+    float tx[PacketSize], tz[PacketSize]; // targets
+};
+struct RayState
+{
+    struct xyz origin, target;
+    int sectorno, prev_sectorno;
+};
+
+// CrossEdge: Determine which rays of the packet cross the edge (x2,y2)-(x3,y3).
+// Returns a bitmask of the rays. This is IntersectLineSegments() for each ray.
+static unsigned CrossEdge(const struct RayPacket* p, float x2,float y2, float x3,float y3)
+{
+    float emin_x = min(x2,x3), emax_x = max(x2,x3), emin_y = min(y2,y3), emax_y = max(y2,y3);
+#if defined(__AVX__)
+    #define vec             __m256
+    #define VecSize         8
+    #define vload           _mm256_loadu_ps
+    #define vset1           _mm256_set1_ps
+    #define vsub            _mm256_sub_ps
+    #define vmul            _mm256_mul_ps
+    #define vmin            _mm256_min_ps
+    #define vmax            _mm256_max_ps
+    #define vand            _mm256_and_ps
+    #define vor             _mm256_or_ps
+    #define vandnot         _mm256_andnot_ps
+    #define vle(a,b)        _mm256_cmp_ps(a,b, _CMP_LE_OQ)
+    #define vgt(a,b)        _mm256_cmp_ps(a,b, _CMP_GT_OQ)
+    #define vlt(a,b)        _mm256_cmp_ps(a,b, _CMP_LT_OQ)
+    #define vmask           _mm256_movemask_ps
+#elif defined(__SSE__)
+    #define vec             __m128
+    #define VecSize         4
+    #define vload           _mm_loadu_ps
+    #define vset1           _mm_set1_ps
+    #define vsub            _mm_sub_ps
+    #define vmul            _mm_mul_ps
+    #define vmin            _mm_min_ps
+    #define vmax            _mm_max_ps
+    #define vand            _mm_and_ps
+    #define vor             _mm_or_ps
+    #define vandnot         _mm_andnot_ps
+    #define vle(a,b)        _mm_cmple_ps(a,b)
+    #define vgt(a,b)        _mm_cmpgt_ps(a,b)
+    #define vlt(a,b)        _mm_cmplt_ps(a,b)
+    #define vmask           _mm_movemask_ps
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // Comparison results are kept as floats, so that they mix with the other operations.
+    #define vec             float32x4_t
+    #define VecSize         4
+    #define vload           vld1q_f32
+    #define vset1           vdupq_n_f32
+    #define vsub            vsubq_f32
+    #define vmul            vmulq_f32
+    #define vmin            vminq_f32
+    #define vmax            vmaxq_f32
+    #define vbits(op, a,b)  vreinterpretq_f32_u32(op(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)))
+    #define vand(a,b)       vbits(vandq_u32, a,b)
+    #define vor(a,b)        vbits(vorrq_u32, a,b)
+    #define vandnot(a,b)    vbits(vbicq_u32, b,a)
+    #define vle(a,b)        vreinterpretq_f32_u32(vcleq_f32(a,b))
+    #define vgt(a,b)        vreinterpretq_f32_u32(vcgtq_f32(a,b))
+    #define vlt(a,b)        vreinterpretq_f32_u32(vcltq_f32(a,b))
+    #define vmask           NeonMask
+#endif
+#ifdef VecSize
+    // Same operations in the same order as the scalar macros, so the results match exactly.
+    #define vxsv(x0,y0, x1,y1) vsub(vmul(x0,y1), vmul(x1,y0))
+    #define SameSide(a,b) vor(vand(vgt(a,zero),vgt(b,zero)), vand(vlt(a,zero),vlt(b,zero)))
+    const vec zero = vset1(0.f);
+    const vec ex2 = vset1(x2), ey2 = vset1(y2), ex3 = vset1(x3), ey3 = vset1(y3);
+    unsigned result = 0;
+    for(unsigned n = 0; n < PacketSize; n += VecSize)
     {
-        bounding_min->x = min(bounding_min->x, sect->vertex[s].x);
-        bounding_min->y = min(bounding_min->y, sect->vertex[s].y);
-        bounding_max->x = max(bounding_max->x, sect->vertex[s].x);
-        bounding_max->y = max(bounding_max->y, sect->vertex[s].y);
+        vec x0 = vload(p->ox+n), y0 = vload(p->oz+n), x1 = vload(p->tx+n), y1 = vload(p->tz+n);
+        vec box = vand(vand(vle(vmin(x0,x1), vset1(emax_x)), vle(vset1(emin_x), vmax(x0,x1))),
+                       vand(vle(vmin(y0,y1), vset1(emax_y)), vle(vset1(emin_y), vmax(y0,y1))));
+        vec c2 = vxsv(vsub(x1,x0), vsub(y1,y0), vsub(ex2,x0), vsub(ey2,y0));
+        vec c3 = vxsv(vsub(x1,x0), vsub(y1,y0), vsub(ex3,x0), vsub(ey3,y0));
+        vec c0 = vxsv(vsub(ex3,ex2), vsub(ey3,ey2), vsub(x0,ex2), vsub(y0,ey2));
+        vec c1 = vxsv(vsub(ex3,ex2), vsub(ey3,ey2), vsub(x1,ex2), vsub(y1,ey2));
+        vec cross = vandnot(vor(SameSide(c2,c3), SameSide(c0,c1)), box);
+        result |= (unsigned)vmask(cross) << n;
     }
+    return result;
+    #undef SameSide
+    #undef vxsv
+#else
+    (void)emin_x; (void)emax_x; (void)emin_y; (void)emax_y;
+    unsigned result = 0;
+    for(unsigned n = 0; n < PacketSize; ++n)
+        if(IntersectLineSegments(p->ox[n],p->oz[n], p->tx[n],p->tz[n], x2,y2, x3,y3))
+            result |= 1u << n;
+    return result;
+#endif
+    #undef vec
+    #undef VecSize
+    #undef vload
+    #undef vset1
+    #undef vsub
+    #undef vmul
+    #undef vmin
+    #undef vmax
+    #undef vand
+    #undef vor
+    #undef vandnot
+    #undef vle
+    #undef vgt
+    #undef vlt
+    #undef vmask
+    #undef vbits
 }
 
+// StepRay: Follow a ray through the sector it is in. Bit "lane" of crossings[c]
+// tells whether the ray crosses the edge candidates[c].
 // Return values:
+//   -1 = the ray went through a portal; *ray is now in the next sector
 //    0 = clear path, nothing hit
 //    1 = hit, *result indicates where it hit
 //    2 = your princess is in another castle (a direct path doesn't lead to this sector)
-static int IntersectRay(struct xyz origin, int origin_sectorno,
-                        struct xyz target, int target_sectorno,
-                        struct Intersection* result)
+static int StepRay(struct RayState* ray, int target_sectorno,
+                   const unsigned short* candidates, unsigned ncandidates,
+                   const unsigned char* crossings, unsigned lane,
+                   struct Intersection* result)
 {
-    unsigned n_rescan=0;
-    int prev_sectorno=-1;
-rescan:;
-    ++n_rescan;
+    struct xyz origin = ray->origin, target = ray->target;
+    int origin_sectorno = ray->sectorno, prev_sectorno = ray->prev_sectorno, moved = 0;
 
-    struct sector* sect = &sectors[origin_sectorno];
+    const struct sector* sect = &sectors[origin_sectorno];
+    const struct SectorAccel* acc = &sector_accel[origin_sectorno];
     /*printf("Intersect: Now in sector %d at %.3f %.3f %.3f, going towards sector %d at %.3f %.3f %.3f\n",
         origin_sectorno,origin.x,origin.y,origin.z,
         target_sectorno,target.x,target.y,target.z);*/
@@ -439,12 +917,15 @@ rescan:;
     unsigned u=0, v=0, lu=0, lv=0;
     struct xyz tangent, bitangent;
 
-    for(int s = 0; s < sect->npoints; ++s)
+    for(unsigned c = 0; c < ncandidates; ++c)
     {
+        int s = candidates[c];
         float vx1 = sect->vertex[s+0].x, vy1 = sect->vertex[s+0].y;
         float vx2 = sect->vertex[s+1].x, vy2 = sect->vertex[s+1].y;
 
-        if(!IntersectLineSegments(origin.x,origin.z, target.x,target.z, vx1,vy1, vx2,vy2)/*
+        // Once the origin has moved, the packet's crossings no longer apply.
+        if(!(moved ? IntersectLineSegments(origin.x,origin.z, target.x,target.z, vx1,vy1, vx2,vy2)
+                   : (crossings[c] >> lane) & 1)/*
         || PointSide(target.x,target.z, vx1,vy1, vx2,vy2) >= 0*/)
             continue;
 
@@ -465,12 +946,7 @@ rescan:;
             x,y,z);*/
 
         /* Check where the hole is. */
-        float hole_low = 9e9, hole_high = -9e9;
-        if(sect->neighbors[s] >= 0)
-        {
-            hole_low  = max( sect->floor, sectors[sect->neighbors[s]].floor );
-            hole_high = min( sect->ceil,  sectors[sect->neighbors[s]].ceil  );
-        }
+        float hole_low = acc->hole_low[s], hole_high = acc->hole_high[s];
 
         if(y >= hole_low && y <= hole_high)
         {
@@ -484,6 +960,7 @@ rescan:;
             if(origin_sectorno == prev_sectorno)
             {
                 // Disregard this boundary.
+                moved = 1;
                 continue;
             }
             if(distance < 1e-3f || origin_sectorno == prev_sectorno)
@@ -491,8 +968,10 @@ rescan:;
                 // Close enough.
                 goto close_enough;
             }
-            prev_sectorno = origin_sectorno;
-            goto rescan;
+            ray->origin        = origin;
+            ray->sectorno      = origin_sectorno;
+            ray->prev_sectorno = origin_sectorno;
+            return -1;
         }
 
         // It hit the wall.
@@ -518,13 +997,13 @@ rescan:;
         v = (unsigned)((y - sect->floor) * 1024.f / (sect->ceil - sect->floor)) % 1024u;
         u = (abs(dx) > abs(dy) ? (unsigned)((x - vx1) * 1024 / dx)
                                : (unsigned)((z - vy1) * 1024 / dy)) % 1024u;
-        // Lightmap coordinates are the same as texture coordinates.
+        // The lightmap has the same columns, but its row 0 is at the ceiling, like in the bake.
         lu = u;
-        lv = v;
+        lv = (unsigned)((sect->ceil - y) * 1024.f / (sect->ceil - sect->floor)) % 1024u;
     perturb_normal:;
         int texture_sample = result->surface->texture[v][u];
         int normal_sample  = result->surface->normalmap[v][u];
-        int light_sample   = result->surface->lightmap[lv][lu];
+        int light_sample   = LightmapAt(result->surface, lu, lv);
         result->sample = ApplyLight(texture_sample, light_sample);
         result->normal = PerturbNormal(result->normal, tangent, bitangent, normal_sample);
         return 1;
@@ -547,10 +1026,8 @@ rescan:;
         u = ((unsigned)(result->where.x * 256)) % 1024u;
         v = ((unsigned)(result->where.z * 256)) % 1024u;
         // Calculate the lightmap coordinates.
-        struct xy bounding_min = {1e9f, 1e9f}, bounding_max = {-1e9f, -1e9f};
-        GetSectorBoundingBox(origin_sectorno, &bounding_min, &bounding_max);
-        lu = ((unsigned)((result->where.x - bounding_min.x) * 1024 / (bounding_max.x - bounding_min.x))) % 1024;
-        lv = ((unsigned)((result->where.y - bounding_min.y) * 1024 / (bounding_max.y - bounding_min.y))) % 1024;
+        lu = ((unsigned)((result->where.x - acc->bounding_min.x) * 1024 / (acc->bounding_max.x - acc->bounding_min.x))) % 1024;
+        lv = ((unsigned)((result->where.z - acc->bounding_min.y) * 1024 / (acc->bounding_max.y - acc->bounding_min.y))) % 1024;
         goto perturb_normal;
     }
     if(target.y < sect->floor)
@@ -570,10 +1047,64 @@ close_enough:;
     return origin_sectorno == target_sectorno ? 0 : 2;
 }
 
+// IntersectRays: Trace count (at most PacketSize) rays from origin to each of targets.
+// hits[n] receives what IntersectRay would return for targets[n], results[n] the hit.
+static void IntersectRays(struct xyz origin, int origin_sectorno,
+                          const struct xyz* targets, unsigned count, int target_sectorno,
+                          struct Intersection* results, int* hits)
+{
+    struct RayPacket packet;
+    struct RayState rays[PacketSize];
+    for(unsigned n = 0; n < PacketSize; ++n)
+    {
+        // Unused lanes repeat the first ray; their results are ignored.
+        rays[n] = (struct RayState) { origin, targets[n < count ? n : 0], origin_sectorno, -1 };
+        packet.ox[n] = origin.x;         packet.oz[n] = origin.z;
+        packet.tx[n] = rays[n].target.x; packet.tz[n] = rays[n].target.z;
+    }
+
+    unsigned active = (1u << count) - 1;
+    while(active)
+    {
+        // Take all the rays that are in the same sector as the first active one.
+        int sectorno = rays[__builtin_ctz(active)].sectorno;
+        const struct sector* sect = &sectors[sectorno];
+        unsigned group = 0;
+        struct xy bmin = {1e9f, 1e9f}, bmax = {-1e9f, -1e9f};
+        for(unsigned n = 0; n < count; ++n)
+            if((active & (1u << n)) && rays[n].sectorno == sectorno)
+            {
+                group |= 1u << n;
+                packet.ox[n] = rays[n].origin.x;
+                packet.oz[n] = rays[n].origin.z;
+                bmin.x = min(bmin.x, min(rays[n].origin.x, rays[n].target.x));
+                bmin.y = min(bmin.y, min(rays[n].origin.z, rays[n].target.z));
+                bmax.x = max(bmax.x, max(rays[n].origin.x, rays[n].target.x));
+                bmax.y = max(bmax.y, max(rays[n].origin.z, rays[n].target.z));
+            }
+
+        unsigned short candidates[MaxEdges];
+        unsigned char crossings[MaxEdges];
+        unsigned ncandidates = FindEdgeCandidates(&sector_accel[sectorno], 1, 0, sect->npoints,
+                                                  bmin.x,bmin.y, bmax.x,bmax.y, candidates, 0);
+        for(unsigned c = 0; c < ncandidates; ++c)
+        {
+            unsigned s = candidates[c];
+            crossings[c] = CrossEdge(&packet, sect->vertex[s].x,sect->vertex[s].y, sect->vertex[s+1].x,sect->vertex[s+1].y) & group;
+        }
+
+        for(unsigned n = 0; n < count; ++n)
+            if(group & (1u << n))
+            {
+                int r = StepRay(&rays[n], target_sectorno, candidates, ncandidates, crossings, n, &results[n]);
+                if(r >= 0) { hits[n] = r; active &= ~(1u << n); }
+            }
+    }
+}
+
 #define narealightcomponents    32 //512;//64
 #define area_light_radius       0.4
 #define nrandomvectors          128 // 8192
-#define firstround              1
 #define maxrounds               100
 #define fade_distance_diffuse   10.0
 #define fade_distance_radiosity 10.0
@@ -584,7 +1115,7 @@ static struct xyz avec[narealightcomponents];
 static void DiffuseLightCalculation(struct xyz normal, struct xyz tangent, struct xyz bitangent,
                                     struct TextureSet* texture,
                                     unsigned tx, unsigned ty,
-                                    unsigned lx, unsigned ly,
+                                    int* target,
                                     struct xyz point_in_wall, unsigned sectorno)
 {
     struct xyz perturbed_normal = PerturbNormal(normal,tangent,bitangent,
@@ -601,6 +1132,10 @@ static void DiffuseLightCalculation(struct xyz normal, struct xyz tangent, struc
         struct xyz source = { point_in_wall.x + normal.x * 1e-5f,
                               point_in_wall.y + normal.y * 1e-5f,
                               point_in_wall.z + normal.z * 1e-5f };
+        // Gather the samples that contribute into packets of rays.
+        struct xyz targets[PacketSize];
+        float powers[PacketSize];
+        unsigned npacket = 0;
         for(unsigned qa=0; qa<narealightcomponents; ++qa)
         {
             struct xyz target = { light->where.x + avec[qa].x, light->where.y + avec[qa].y, light->where.z + avec[qa].z };
@@ -616,20 +1151,31 @@ static void DiffuseLightCalculation(struct xyz normal, struct xyz tangent, struc
             power /= (float) narealightcomponents;
             if(power > 1e-7f)
             {
-                struct Intersection i;
-                if(IntersectRay(source, sectorno, target, light->sector, &i) == 0)
-                {
-                    color.x += light->light.x * power;
-                    color.y += light->light.y * power;
-                    color.z += light->light.z * power;
-    }   }   }   }
-    PutColor(&texture->lightmap[lx][ly], color);
+                targets[npacket] = target;
+                powers[npacket]  = power;
+                ++npacket;
+            }
+            if(npacket == PacketSize || (npacket > 0 && qa == narealightcomponents-1))
+            {
+                struct Intersection i[PacketSize];
+                int hits[PacketSize];
+                IntersectRays(source, sectorno, targets, npacket, light->sector, i, hits);
+                for(unsigned n=0; n<npacket; ++n)
+                    if(hits[n] == 0)
+                    {
+                        color.x += light->light.x * powers[n];
+                        color.y += light->light.y * powers[n];
+                        color.z += light->light.z * powers[n];
+                    }
+                npacket = 0;
+    }   }   }
+    PutColor(target, color);
 }
 
 static void RadiosityCalculation(struct xyz normal, struct xyz tangent, struct xyz bitangent,
                                  struct TextureSet* texture,
                                  unsigned tx, unsigned ty,
-                                 unsigned lx, unsigned ly,
+                                 int* target,
                                  struct xyz point_in_wall, unsigned sectorno)
 {
     struct xyz perturbed_normal = PerturbNormal(normal,tangent,bitangent,
@@ -646,310 +1192,672 @@ static void RadiosityCalculation(struct xyz normal, struct xyz tangent, struct x
     // This produces a set of vectors all pointing away
     // from the wall to random directions.
     struct xyz color = {0,0,0};
-    for(unsigned qq=0; qq<nrandomvectors; ++qq)
+    for(unsigned qq=0; qq<nrandomvectors; qq += PacketSize)
     {
-        struct xyz rvec = tvec[qq];
-        // If the random vector points to the wrong side from the wall, flip it
-        if(vdot3(rvec.x, rvec.y, rvec.z, normal.x, normal.y, normal.z) < 0)
+        struct xyz targets[PacketSize];
+        unsigned npacket = min(PacketSize, nrandomvectors - qq);
+        for(unsigned n=0; n<npacket; ++n)
         {
-            rvec.x = -rvec.x;
-            rvec.y = -rvec.y;
-            rvec.z = -rvec.z;
-        }
+            struct xyz rvec = tvec[qq+n];
+            // If the random vector points to the wrong side from the wall, flip it
+            if(vdot3(rvec.x, rvec.y, rvec.z, normal.x, normal.y, normal.z) < 0)
+            {
+                rvec.x = -rvec.x;
+                rvec.y = -rvec.y;
+                rvec.z = -rvec.z;
+            }
 
-        struct xyz target = { source.x + rvec.x * 512.f,
-                              source.y + rvec.y * 512.f,
-                              source.z + rvec.z * 512.f };
+            targets[n] = (struct xyz) { source.x + rvec.x * 512.f,
+                                        source.y + rvec.y * 512.f,
+                                        source.z + rvec.z * 512.f };
+        }
 
-        struct Intersection i;
-        if(IntersectRay(source, sectorno, target, -1 /* no particular sector */, &i) == 1) // hit something
+        struct Intersection hit[PacketSize];
+        int hits[PacketSize];
+        IntersectRays(source, sectorno, targets, npacket, -1 /* no particular sector */, hit, hits);
+        for(unsigned n=0; n<npacket; ++n)
         {
-            float cosine = vdot3(perturbed_normal.x, i.normal.x,
-                                 perturbed_normal.y, i.normal.y,
-                                 perturbed_normal.z, i.normal.z) * basepower;
-            float len = vlen(i.where.x-source.x, i.where.y-source.y, i.where.z-source.z);
+            if(hits[n] != 1) continue; // didn't hit anything
+            const struct Intersection* i = &hit[n];
+            float cosine = vdot3(perturbed_normal.x, i->normal.x,
+                                 perturbed_normal.y, i->normal.y,
+                                 perturbed_normal.z, i->normal.z) * basepower;
+            float len = vlen(i->where.x-source.x, i->where.y-source.y, i->where.z-source.z);
             float power = abs(cosine) / (1.f + powf(len / fade_distance_radiosity, 2.0f));
-            color.x += ((i.sample >> 16) & 0xFF) * power;
-            color.y += ((i.sample >>  8) & 0xFF) * power;
-            color.z += ((i.sample >>  0) & 0xFF) * power;
+            color.x += ((i->sample >> 16) & 0xFF) * power;
+            color.y += ((i->sample >>  8) & 0xFF) * power;
+            color.z += ((i->sample >>  0) & 0xFF) * power;
     }   }
-    AddColor(&texture->lightmap[lx][ly], color);
+    AddColor(target, color); // onto the diffuse light
 }
 
-static void Begin_Radiosity(struct TextureSet* set)
+/* A radiosity round gathers the light of a tile into a buffer that starts out
+ * as the diffuse light, and then stores it over the last round's light.
+ */
+static void Begin_Radiosity(struct TextureSet* set, unsigned x0, unsigned y0, unsigned w, unsigned h,
+                            int light[TileSize][TileSize])
 {
-    memcpy(&set->lightmap, &set->lightmap_diffuseonly, sizeof(Texture));
+    for(unsigned x=0; x<w; ++x)
+        memcpy(light[x], &Lightmap(diffuse_pages, set, x0+x,y0), h * sizeof(int));
 }
-static double End_Radiosity(struct TextureSet* set, const char* label)
+static float End_Radiosity(struct TextureSet* set, unsigned x0, unsigned y0, unsigned w, unsigned h,
+                           int light[TileSize][TileSize])
 {
     long differences = 0;
-    for(unsigned x=0; x<1024; ++x)
-    for(unsigned y=0; y<1024; ++y)
+    for(unsigned x=0; x<w; ++x)
+    for(unsigned y=0; y<h; ++y)
     {
-        int old = set->lightmap_diffuseonly[x][y];
+        int old = Lightmap(lightmap_pages, set, x0+x,y0+y);
         int r = (old >> 16) & 0xFF, g = (old >> 8) & 0xFF, b = (old) & 0xFF;
-        int new = set->lightmap[x][y];
+        int new = light[x][y];
         r -= (new >> 16) & 0xFF; g -= (new >> 8) & 0xFF; b -= (new) & 0xFF;
         differences += abs(r) + abs(g) + abs(b);
+        Lightmap(lightmap_pages, set, x0+x,y0+y) = new;
     }
-    double result = differences / (double)(1024*1024);
-    fprintf(stderr, "Differences in %s: %g\33[K\n", label, result);
-    return result;
+    return differences / (float)(w * h);
+}
+static void End_Diffuse(struct TextureSet* set, unsigned x0, unsigned y0, unsigned w, unsigned h)
+{
+    for(unsigned x=0; x<w; ++x)
+        memcpy(&Lightmap(diffuse_pages, set, x0+x,y0), &Lightmap(lightmap_pages, set, x0+x,y0), h * sizeof(int));
 }
-static void End_Diffuse(struct TextureSet* set)
+
+// To565: An RGB color in 565 bits, rounded.
+static unsigned short To565(int r, int g, int b)
 {
-    memcpy(&set->lightmap_diffuseonly, &set->lightmap, sizeof(Texture));
+    return ((r*31 + 127) / 255) << 11 | ((g*63 + 127) / 255) << 5 | ((b*31 + 127) / 255);
+}
+
+/* PackLightmap: Pack a part of a lightmap, which is in whole blocks, for the renderer.
+ * The two colors of a block are the corners of the box that its texels' colors
+ * span, inset a little so that the odd bright or dark texel doesn't stretch the
+ * whole block. Each texel then picks the nearest of the four colors.
+ */
+static void PackLightmap(const struct TextureSet* set, unsigned x0, unsigned y0, unsigned w, unsigned h)
+{
+    for(unsigned bx=0; bx<w; bx+=LightmapBlockSize)
+    for(unsigned by=0; by<h; by+=LightmapBlockSize)
+    {
+        int texels[LightmapBlockSize*LightmapBlockSize];
+        int lo[3] = {255,255,255}, hi[3] = {0,0,0};
+        for(unsigned n=0; n<LightmapBlockSize*LightmapBlockSize; ++n)
+        {
+            texels[n] = Lightmap(lightmap_pages, set, x0+bx + n/LightmapBlockSize, y0+by + n%LightmapBlockSize);
+            for(unsigned c=0; c<3; ++c)
+            {
+                int value = (texels[n] >> (16 - 8*c)) & 0xFF;
+                lo[c] = min(lo[c], value);
+                hi[c] = max(hi[c], value);
+            }
+        }
+        for(unsigned c=0; c<3; ++c)
+        {
+            int inset = (hi[c] - lo[c]) / 16;
+            lo[c] += inset;
+            hi[c] -= inset;
+        }
+
+        struct LightmapBlock* block = &packed_pages[set->lightmap.page][(set->lightmap.x + x0+bx) / LightmapBlockSize]
+                                                                       [(set->lightmap.y + y0+by) / LightmapBlockSize];
+        block->color0  = To565(hi[0], hi[1], hi[2]);
+        block->color1  = To565(lo[0], lo[1], lo[2]);
+        block->indices = 0;
+        int palette[4];
+        BlockPalette(block, palette);
+        for(unsigned n=0; n<LightmapBlockSize*LightmapBlockSize; ++n)
+        {
+            unsigned best = 0, bestdist = ~0u;
+            for(unsigned i=0; i<4; ++i)
+            {
+                int dr = ((texels[n] >> 16) & 0xFF) - ((palette[i] >> 16) & 0xFF);
+                int dg = ((texels[n] >>  8) & 0xFF) - ((palette[i] >>  8) & 0xFF);
+                int db = ((texels[n] >>  0) & 0xFF) - ((palette[i] >>  0) & 0xFF);
+                unsigned dist = dr*dr + dg*dg + db*db;
+                if(dist < bestdist) { bestdist = dist; best = i; }
+            }
+            block->indices |= best << 2*n;
+        }
+    }
 }
 
 #ifdef _OPENMP
 # include <omp.h>
+#endif
 
-#define OMP_SCALER_LOOP_BEGIN(a,b,c,d,e,f) do { \
-    int this_thread = omp_get_thread_num(), num_threads = omp_get_num_threads(); \
-    int my_start = (this_thread  ) * ((c)-(a)) / num_threads + (a); \
-    int my_end   = (this_thread+1) * ((c)-(a)) / num_threads + (a); \
-    struct Scaler e##int = Scaler_Init(a, my_start, (c)-1, (d) * 32768, (f) * 32768); \
-    for(int b = my_start; b < my_end; ++b) \
-    { \
-        float e = Scaler_Next(&e##int) / 32768.f;
+/* The lightmap bake is a graph of jobs. Every surface (a floor, a ceiling,
+ * or a wall with its upper and lower parts) is split into tiles of
+ * TileSize*TileSize lightmap texels, and the tiles of all surfaces form a
+ * single pool that the worker threads drain. When the last tile of a surface
+ * is done, the thread that finished it also finishes the surface.
+ */
 
-#else
+struct BakeSurface
+{
+    unsigned sectorno;
+    int wallno;                              // -1 for floors and ceilings
+    struct TextureSet* texture;              // floor or ceiling texture; upper texture for walls
+    struct xyz normal, tangent, bitangent;
+    float height;                            // floor or ceiling height
+    unsigned hash;                           // of everything the lightmap depends on
+    int tiles, tiles_left;                   // tiles, and tiles not done in this round
+    double differences;                      // radiosity change in this round
+};
+static struct BakeSurface* bake_surfaces = NULL;
+static unsigned NumBakeSurfaces = 0;
 
-#define OMP_SCALER_LOOP_BEGIN(a,b,c,d,e,f) do { \
-    struct Scaler e##int = Scaler_Init(a, a, (c)-1, (d) * 32768, (f) * 32768); \
-    for(int b = (a); b < (c); ++b) \
-    { \
-        float e = Scaler_Next(&e##int) / 32768.f;
+// The sectors that can see each sector, and how much light changed in it in the last round.
+struct BakeSector { unsigned nvisible, *visible; float change; };
+static struct BakeSector* bake_sectors = NULL;
 
-#endif
+struct BakeJob { unsigned surface; unsigned short x, y; };
+static struct BakeJob* bake_jobs = NULL;
+static unsigned NumBakeJobs = 0, bake_jobs_done = 0;
 
-#define OMP_SCALER_LOOP_END() \
-    } }  while(0)
+/* Each worker takes jobs from the front of its own range of bake_jobs[].
+ * An idle worker steals the back half of another worker's range. Both ends
+ * of a range share one 64-bit word, so that every update is a single
+ * compare-and-swap. The padding keeps each queue on its own cache line.
+ */
+struct JobQueue { unsigned long long range; char pad[64 - sizeof(unsigned long long)]; };
+#define JobRange(begin,end) (((unsigned long long)(begin) << 32) | (unsigned)(end))
 
-/* My lightmap calculation involves some raytracing.
- * There are faster ways to do it, but this is the only way I know how to do it in software.
+static int PopJob(struct JobQueue* q, unsigned* job)
+{
+    unsigned long long range = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        unsigned begin = range >> 32, end = (unsigned)range;
+        if(begin >= end) return 0;
+        if(__atomic_compare_exchange_n(&q->range, &range, JobRange(begin+1, end),
+                                       0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            { *job = begin; return 1; }
+    }
+}
+static int StealJobs(struct JobQueue* victim, struct JobQueue* thief)
+{
+    unsigned long long range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        unsigned begin = range >> 32, end = (unsigned)range;
+        if(begin >= end) return 0;
+        unsigned half = (end - begin + 1) / 2;
+        if(__atomic_compare_exchange_n(&victim->range, &range, JobRange(begin, end-half),
+                                       0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            // Only the owner refills its own queue, and only when it is empty.
+            __atomic_store_n(&thief->range, JobRange(end-half, end), __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+}
+
+static void AddBakeSurface(struct BakeSurface surf)
+{
+    bake_surfaces = realloc(bake_surfaces, ++NumBakeSurfaces * sizeof(*bake_surfaces));
+    bake_surfaces[NumBakeSurfaces-1] = surf;
+
+    const struct LightmapRect* lightmap = &surf.texture->lightmap;
+    bake_surfaces[NumBakeSurfaces-1].tiles = TilesAlong(lightmap->w) * TilesAlong(lightmap->h);
+}
+
+/* Radiosity converges unevenly: a tile in a corner that the lights don't reach
+ * keeps changing long after a lit floor has settled. After the first radiosity
+ * round, a tile whose texels changed by less than converged_change (summed over
+ * r,g,b, on average) in its last round is skipped, until a tile in a sector that
+ * can see it changes by more than revisit_change. The bake is over when every
+ * tile is skipped.
+ */
+#define converged_change 0.5
+#define revisit_change   4.0
+
+/* QueueBakeJobs: Make jobs of the tiles that have not had this round yet,
+ * and skip those that have converged. Which tiles were queued is kept in
+ * the texture file, so that a resumed round bakes the same tiles.
+ * Returns the number of tiles that had not had this round yet.
  */
-static void BuildLightmaps(void)
+static unsigned QueueBakeJobs(unsigned round)
 {
-    for(unsigned round=firstround; round<=maxrounds; ++round)
+    for(unsigned n=0; n<NumSectors; ++n) bake_sectors[n].change = 0;
+    for(unsigned n=0; n<NumBakeSurfaces; ++n)
     {
-        fprintf(stderr, "Lighting calculation, round %u...\n", round);
-#ifndef _OPENMP
-        fprintf(stderr, "Note: This would probably go faster if you enabled OpenMP in your compiler options. It's -fopenmp in GCC and Clang.\n");
-#endif
+        const struct BakeSurface* surf = &bake_surfaces[n];
+        struct BakeSector* bs = &bake_sectors[surf->sectorno];
+        for(int t=0; t<surf->tiles; ++t) bs->change = max(bs->change, surf->texture->tiles[t].change);
+    }
+
+    unsigned pending = 0;
+    NumBakeJobs = 0;
+    for(unsigned n=0; n<NumBakeSurfaces; ++n)
+    {
+        struct BakeSurface* surf = &bake_surfaces[n];
+        const struct BakeSector* bs = &bake_sectors[surf->sectorno];
+        float contributors = 0;
+        for(unsigned v=0; v<bs->nvisible; ++v) contributors = max(contributors, bake_sectors[bs->visible[v]].change);
+
+        surf->tiles_left  = 0;
+        surf->differences = 0;
+        bake_jobs = realloc(bake_jobs, (NumBakeJobs + surf->tiles) * sizeof(*bake_jobs));
+        for(unsigned x=0; x<surf->texture->lightmap.w; x+=TileSize)
+            for(unsigned y=0; y<surf->texture->lightmap.h; y+=TileSize)
+            {
+                struct TileRecord* tile = &TileAt(surf->texture, x,y);
+                if(tile->round >= round) continue;
+                ++pending;
+                if(round > 2 && tile->change >= 0 && tile->change < converged_change && contributors <= revisit_change)
+                    { tile->round = round; tile->change = 0; continue; }
+                tile->change = -1; // queued
+                bake_jobs[NumBakeJobs++] = (struct BakeJob) { n, x, y };
+                ++surf->tiles_left;
+            }
+        // Done with this round if every tile was skipped.
+        if(surf->tiles_left == 0 && surf->texture->record->round < round)
+            surf->texture->record->round = round;
+    }
+    return pending;
+}
+
+/* A surface is baked again only when something its light depends on has
+ * changed: its own sector, the sectors that can see it, or the lights in them.
+ * The sectors that can see a sector are those reachable through open portals
+ * within bake_dependency_range map units. The hash and the number of rounds
+ * done are kept in the surface's record in the texture file, so an edited map
+ * only rebakes what the edit touched, and an interrupted bake carries on
+ * from the rounds that it finished.
+ */
+#define bake_dependency_range (fade_distance_diffuse * 16)
+
+#define HashValue(hash, value) HashBytes(hash, &(value), sizeof(value))
+static unsigned HashBytes(unsigned hash, const void* data, unsigned size)
+{
+    const unsigned char* p = data;
+    for(unsigned n=0; n<size; ++n) { hash ^= p[n]; hash *= 16777619u; } // FNV-1a
+    return hash;
+}
+
+// SectorDistance: Distance between the bounding boxes of two sectors.
+static float SectorDistance(unsigned a, unsigned b)
+{
+    const struct SectorAccel* p = &sector_accel[a], *q = &sector_accel[b];
+    float dx = max(0.f, max(p->bounding_min.x - q->bounding_max.x, q->bounding_min.x - p->bounding_max.x));
+    float dy = max(0.f, max(p->bounding_min.y - q->bounding_max.y, q->bounding_min.y - p->bounding_max.y));
+    return sqrtf(dx*dx + dy*dy);
+}
 
-        // Create uniformly distributed random unit vectors
-        for(unsigned n=0; n<nrandomvectors; ++n)
+// VisibleSectors: List the sectors that can see this one, starting with itself. Returns their number.
+static unsigned VisibleSectors(unsigned sectorno, unsigned* list)
+{
+    unsigned char* seen = calloc(NumSectors, 1);
+    unsigned head = 0, tail = 0;
+    list[tail++] = sectorno;
+    seen[sectorno] = 1;
+    while(head < tail)
+    {
+        unsigned n = list[head++];
+        for(unsigned s=0; s<sectors[n].npoints; ++s)
         {
-            double u = (rand() % 1000000) / 1e6; // 0..1
-            double v = (rand() % 1000000) / 1e6; // 0..1
-            double theta = 2*3.141592653*u;
-            double phi   = acos(2*v-1);
-            tvec[n].x = cos(theta) * sin(phi);
-            tvec[n].y = sin(theta) * sin(phi);
-            tvec[n].z = cos(phi);
+            int next = sectors[n].neighbors[s];
+            if(next < 0 || seen[next]) continue;
+            if(sector_accel[n].hole_high[s] <= sector_accel[n].hole_low[s]) continue; // closed
+            if(SectorDistance(sectorno, next) > bake_dependency_range) continue;
+            seen[next] = 1;
+            list[tail++] = next;
         }
+    }
+    free(seen);
+    return tail;
+}
 
-        // A lightsource is represented by a spherical cloud
-        // of smaller lightsources around the actual lightsource.
-        // This achieves smooth edges for the shadows.
-        #define drand(m) ((rand()%1000-500)*5e-2*m)
-        for(unsigned qa=0; qa<narealightcomponents; ++qa)
+// SectorDependencies: Hash the sectors that can see this one, and their lights.
+static unsigned SectorDependencies(unsigned sectorno)
+{
+    const struct BakeSector* bs = &bake_sectors[sectorno];
+    unsigned char* seen = calloc(NumSectors, 1);
+    for(unsigned v=0; v<bs->nvisible; ++v) seen[bs->visible[v]] = 1;
+
+    // Go in sector order, so that the hash doesn't depend on the order of the walk.
+    unsigned hash = 2166136261u;
+    for(unsigned n=0; n<NumSectors; ++n)
+    {
+        if(!seen[n]) continue;
+        const struct sector* sect = &sectors[n];
+        hash = HashValue(hash, n);
+        hash = HashValue(hash, sect->floor);
+        hash = HashValue(hash, sect->ceil);
+        hash = HashBytes(hash, sect->vertex,    (sect->npoints+1) * sizeof(*sect->vertex));
+        hash = HashBytes(hash, sect->neighbors, sect->npoints * sizeof(*sect->neighbors));
+    }
+    for(unsigned l=0; l<NumLights; ++l)
+    {
+        if(!seen[lights[l].sector]) continue;
+        hash = HashValue(hash, lights[l].where);
+        hash = HashValue(hash, lights[l].light);
+        hash = HashValue(hash, lights[l].sector);
+    }
+    free(seen);
+    return hash;
+}
+
+// SurfaceHash: Hash everything the lightmap of this surface depends on.
+static unsigned SurfaceHash(const struct BakeSurface* surf, unsigned dependencies)
+{
+    static const float settings[] = { narealightcomponents, area_light_radius, nrandomvectors,
+                                      fade_distance_diffuse, fade_distance_radiosity, radiomul,
+                                      LightmapTexelsPerUnit, bake_dependency_range,
+                                      converged_change, revisit_change };
+    unsigned hash = HashBytes(dependencies, settings, sizeof(settings));
+    hash = HashValue(hash, surf->wallno);
+    hash = HashValue(hash, surf->normal);
+    hash = HashValue(hash, surf->texture->lightmap);
+    return hash;
+}
+
+// ResetSurface: Forget the bake of a surface.
+static void ResetSurface(struct BakeSurface* surf)
+{
+    surf->texture->record->round = 0;
+    for(int t=0; t<surf->tiles; ++t) surf->texture->tiles[t] = (struct TileRecord) { 0, 0 };
+}
+
+static void CreateBakeSurfaces(void)
+{
+    bake_sectors = calloc(NumSectors, sizeof(*bake_sectors));
+    unsigned* visible = malloc(NumSectors * sizeof(*visible));
+    for(unsigned sectorno=0; sectorno<NumSectors; ++sectorno)
+    {
+        struct BakeSector* bs = &bake_sectors[sectorno];
+        bs->nvisible = VisibleSectors(sectorno, visible);
+        bs->visible  = malloc(bs->nvisible * sizeof(*bs->visible));
+        memcpy(bs->visible, visible, bs->nvisible * sizeof(*bs->visible));
+    }
+    free(visible);
+
+    for(unsigned sectorno=0; sectorno<NumSectors; ++sectorno)
+    {
+        struct sector* const sect = &sectors[sectorno];
+        const struct xy* const vert = sect->vertex;
+
+        struct xyz floornormal    = (struct xyz){0, 1, 0}; // floor
+        struct xyz floortangent   = (struct xyz){1, 0, 0};
+        struct xyz floorbitangent = vxs3(floornormal.x,floornormal.y,floornormal.z, floortangent.x,floortangent.y,floortangent.z);
+        struct xyz ceilnormal     = (struct xyz){0,-1, 0}; // ceiling
+        struct xyz ceiltangent    = (struct xyz){1, 0, 0};
+        struct xyz ceilbitangent  = vxs3(ceilnormal.x,ceilnormal.y,ceilnormal.z, ceiltangent.x,ceiltangent.y,ceiltangent.z);
+
+        // For better cache locality, first do floors and then ceils
+        AddBakeSurface((struct BakeSurface) { .sectorno = sectorno, .wallno = -1, .texture = sect->floortexture,
+                                              .normal = floornormal, .tangent = floortangent,
+                                              .bitangent = floorbitangent, .height = sect->floor });
+        AddBakeSurface((struct BakeSurface) { .sectorno = sectorno, .wallno = -1, .texture = sect->ceiltexture,
+                                              .normal = ceilnormal, .tangent = ceiltangent,
+                                              .bitangent = ceilbitangent, .height = sect->ceil });
+
+        for(unsigned s=0; s<sect->npoints; ++s)
         {
-            double len;
-            do {
-              avec[qa] = (struct xyz){ drand(100.0), drand(100.0), drand(100.0) };
-              len = sqrt(avec[qa].x*avec[qa].x + avec[qa].y*avec[qa].y + avec[qa].z*avec[qa].z);
-            } while(len < 1e-3);
-            avec[qa].x *= area_light_radius/len;
-            avec[qa].y *= area_light_radius/len;
-            avec[qa].z *= area_light_radius/len;
+            float xd = vert[s+1].x - vert[s].x;
+            float zd = vert[s+1].y - vert[s].y;
+            float len = vlen(xd,zd,0);
+
+            AddBakeSurface((struct BakeSurface) { .sectorno = sectorno, .wallno = s, .texture = &sect->uppertextures[s],
+                                                  .normal = {-zd/len, 0, xd/len}, .tangent = {xd/len, 0, zd/len},
+                                                  .bitangent = {0,1,0} });
         }
-        #undef drand
+    }
 
+    // Forget the bake of whatever has changed since.
+    unsigned changed = 0;
+    for(unsigned n=0, sectorno=~0u, dependencies=0; n<NumBakeSurfaces; ++n)
+    {
+        struct BakeSurface* surf = &bake_surfaces[n];
+        struct SurfaceRecord* record = surf->texture->record;
+        if(surf->sectorno != sectorno) dependencies = SectorDependencies(sectorno = surf->sectorno);
+        surf->hash = SurfaceHash(surf, dependencies);
+        if(record->hash != surf->hash) { record->hash = surf->hash; ResetSurface(surf); }
+        changed += record->round == 0;
+    }
+    fprintf(stderr, "%u surfaces, %u of them to bake from the start.\n", NumBakeSurfaces, changed);
+}
 
-        fprintf(stderr, "Note: You can interrupt this program at any time you want. If you wish to resume\n"
-                        "      the lightmap calculation at a later date, use the --rebuild commandline option.\n"
-                        "      If you have already finished round 1 (diffuse light), and don't wish to do that\n"
-                        "      again, change the '#define firstround' value to your liking. Value 1 means\n"
-                        "      it starts from beginning, and any value from 2-100 (actual value is not important)\n"
-                        "      means to progressively improve the radiosity (cumulative). The current value is %d.\n",
-            firstround);
+/* Light one tile. Round 1 gathers the light sources, later rounds gather radiosity.
+ * Returns how much the tile changed, on average per texel.
+ */
+static float BakeTile(const struct BakeJob* job, unsigned round)
+{
+    const struct BakeSurface* surf = &bake_surfaces[job->surface];
+    struct sector* const sect = &sectors[surf->sectorno];
+    const struct xy* const vert = sect->vertex;
+    void (*calculation)(struct xyz, struct xyz, struct xyz, struct TextureSet*,
+                        unsigned, unsigned, int*, struct xyz, unsigned)
+        = round == 1 ? DiffuseLightCalculation : RadiosityCalculation;
 
-        double total_differences = 0;
-        for(unsigned sectorno=0; sectorno<NumSectors; ++sectorno)
-        {
-            struct sector* const sect = &sectors[sectorno];
-            const struct xy* const vert = sect->vertex;
+    int w = surf->texture->lightmap.w, h = surf->texture->lightmap.h;
+    int xend = min(job->x + TileSize, w), yend = min(job->y + TileSize, h);
 
-            double sector_differences = 0;
+    int light[TileSize][TileSize];
+    if(round > 1) Begin_Radiosity(surf->texture, job->x, job->y, xend-job->x, yend-job->y, light);
+    #define Target(x,y) (round == 1 ? &Lightmap(lightmap_pages, surf->texture, x,y) : &light[(x)-job->x][(y)-job->y])
+
+    if(surf->wallno < 0)
+    {
+        struct xy bounding_min = sector_accel[surf->sectorno].bounding_min, bounding_max = sector_accel[surf->sectorno].bounding_max;
 
-            if(1) // Do ceiling and floor
+        struct Scaler txtx_int = Scaler_Init(0,0,w-1, bounding_min.x*32768, bounding_max.x*32768);
+        Scaler_Skip(&txtx_int, job->x);
+        for(int x=job->x; x<xend; ++x)
+        {
+            float txtx = Scaler_Next(&txtx_int)/32768.f;
+            struct Scaler txty_int = Scaler_Init(0,0,h-1, bounding_min.y*32768, bounding_max.y*32768);
+            Scaler_Skip(&txty_int, job->y);
+            for(int y=job->y; y<yend; ++y)
             {
-                struct xy bounding_min = {1e9f, 1e9f}, bounding_max = {-1e9f, -1e9f};
-                GetSectorBoundingBox(sectorno, &bounding_min, &bounding_max);
-                struct xyz floornormal    = (struct xyz){0, 1, 0}; // floor
-                struct xyz floortangent   = (struct xyz){1, 0, 0};
-                struct xyz floorbitangent = vxs3(floornormal.x,floornormal.y,floornormal.z, floortangent.x,floortangent.y,floortangent.z);
-                struct xyz ceilnormal     = (struct xyz){0,-1, 0}; // ceiling
-                struct xyz ceiltangent    = (struct xyz){1, 0, 0};
-                struct xyz ceilbitangent  = vxs3(ceilnormal.x,ceilnormal.y,ceilnormal.z, ceiltangent.x,ceiltangent.y,ceiltangent.z);
-
-                fprintf(stderr, "Bounding box for sector %d/%d: %g,%g - %g,%g\n",
-                    sectorno+1,NumSectors, bounding_min.x,bounding_min.y, bounding_max.x,bounding_max.y);
-                // Round 1: Check lightsources
-                if(round == 1)
+                float txty = Scaler_Next(&txty_int)/32768.f;
+                calculation(surf->normal, surf->tangent, surf->bitangent, surf->texture,
+                            ((unsigned)(txtx*256)) % 1024, ((unsigned)(txty*256)) % 1024,
+                            Target(x,y),
+                            (struct xyz){txtx, surf->height, txty}, surf->sectorno);
+            }
+        }
+    }
+    else
+    {
+        unsigned s = surf->wallno;
+        float hole_low = sector_accel[surf->sectorno].hole_low[s], hole_high = sector_accel[surf->sectorno].hole_high[s];
+
+        struct Scaler txtx_int = Scaler_Init(0,0,w-1, vert[s].x*32768,vert[s+1].x*32768);
+        struct Scaler txtz_int = Scaler_Init(0,0,w-1, vert[s].y*32768,vert[s+1].y*32768);
+        Scaler_Skip(&txtx_int, job->x);
+        Scaler_Skip(&txtz_int, job->x);
+        for(int x=job->x; x<xend; ++x)
+        {
+            float txtx = Scaler_Next(&txtx_int)/32768.f;
+            float txtz = Scaler_Next(&txtz_int)/32768.f;
+            struct Scaler txty_int = Scaler_Init(0,0,h-1, sect->ceil*32768, sect->floor*32768);
+            Scaler_Skip(&txty_int, job->y);
+            for(int y=job->y; y<yend; ++y)
+            {
+                float txty = Scaler_Next(&txty_int)/32768.f;
+                struct TextureSet* texture = &sect->uppertextures[s];
+
+                if(sect->neighbors[s] >= 0 && txty < hole_high)
                 {
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, bounding_min.x*32768, bounding_max.x*32768);
-                    for(unsigned x=0; x<1024; ++x)
-                    {
-                        fprintf(stderr, "- Sector %d ceils&floors, %u/%u diffuse light...\r", sectorno+1, x,1024);
-                        float txtx = Scaler_Next(&txtx_int)/32768.f;
-
-                        // For better cache locality, first do floors and then ceils
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, bounding_min.y, txty, bounding_max.y);
-                            DiffuseLightCalculation(floornormal, floortangent, floorbitangent, sect->floortexture,
-                                                    ((unsigned)(txtx*256)) % 1024, ((unsigned)(txty*256)) % 1024,
-                                                    x,y,
-                                                    (struct xyz){txtx, sect->floor, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, bounding_min.y, txty, bounding_max.y);
-                            DiffuseLightCalculation(ceilnormal, ceiltangent, ceilbitangent, sect->ceiltexture,
-                                                    ((unsigned)(txtx*256)) % 1024, ((unsigned)(txty*256)) % 1024,
-                                                    x,y,
-                                                    (struct xyz){txtx, sect->ceil, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
-                    fprintf(stderr, "\n");
-                    End_Diffuse(sect->floortexture);
-                    End_Diffuse(sect->ceiltexture);
+                    if(txty > hole_low) continue;
+                    texture = &sect->lowertextures[s];
                 }
-                else
-                {
-                    // Round 2+: Radiosity
-                    Begin_Radiosity(sect->floortexture);
-                    Begin_Radiosity(sect->ceiltexture);
-
-                    // Calculate radiosity in decreased resolution
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, bounding_min.x*32768, bounding_max.x*32768);
-                    for(unsigned x=0; x<1024; ++x)
-                    {
-                        float txtx = Scaler_Next(&txtx_int)/32768.f;
-
-                        fprintf(stderr, "- Sector %u ceils&floors, %u/%u radiosity...\r", sectorno+1, x,1024);
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, bounding_min.y, txty, bounding_max.y);
-                            RadiosityCalculation(floornormal, floortangent, floorbitangent, sect->ceiltexture,
-                                                 ((unsigned)(txtx*256)) % 1024, ((unsigned)(txty*256)) % 1024, x,y,
-                                                 (struct xyz){txtx, sect->floor, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, bounding_min.y, txty, bounding_max.y);
-                            RadiosityCalculation(ceilnormal, ceiltangent, ceilbitangent, sect->ceiltexture,
-                                                 ((unsigned)(txtx*256)) % 1024, ((unsigned)(txty*256)) % 1024, x,y,
-                                                 (struct xyz){txtx, sect->ceil, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
 
-                    char Buf[128];
-                    sprintf(Buf, "Sector %u floors", sectorno+1); sector_differences += End_Radiosity(sect->floortexture, Buf);
-                    sprintf(Buf, "Sector %u ceils", sectorno+1); sector_differences += End_Radiosity(sect->ceiltexture, Buf);
-                }
+                struct xyz point_in_wall = { txtx, txty, txtz };
+                calculation(surf->normal, surf->tangent, surf->bitangent, texture, x*1024/w, y*1024/h, Target(x,y),
+                            point_in_wall, surf->sectorno);
             }
+        }
+    }
+    #undef Target
 
-            if(1)for(unsigned s=0; s<sect->npoints; ++s)
-            {
-                float xd = vert[s+1].x - vert[s].x;
-                float zd = vert[s+1].y - vert[s].y;
-                float len = vlen(xd,zd,0);
+    // Walls: The lower texture shares the lightmap with the upper texture.
+    float change = 0;
+    if(round > 1)
+        change = End_Radiosity(surf->texture, job->x, job->y, xend-job->x, yend-job->y, light);
+    else
+        End_Diffuse(surf->texture, job->x, job->y, xend-job->x, yend-job->y);
+    PackLightmap(surf->texture, job->x, job->y, xend-job->x, yend-job->y);
+    return change;
+}
 
-                struct xyz normal    = {-zd/len, 0, xd/len};
-                struct xyz tangent   = {xd/len, 0, zd/len};
-                struct xyz bitangent = {0,1,0};
+static void FinishSurface(struct BakeSurface* surf, unsigned round)
+{
+    struct sector* const sect = &sectors[surf->sectorno];
+    unsigned s = surf->wallno;
+    char Buf[128];
 
-                float hole_low = 9e9, hole_high = -9e9;
-                if(sect->neighbors[s] >= 0)
-                {
-                    hole_low  = max( sect->floor, sectors[sect->neighbors[s]].floor );
-                    hole_high = min( sect->ceil,  sectors[sect->neighbors[s]].ceil  );
-                }
+    if(round > 1)
+    {
+        if(surf->wallno < 0)
+            sprintf(Buf, "Sector %u %s", surf->sectorno+1, surf->texture == sect->floortexture ? "floors" : "ceils");
+        else
+            sprintf(Buf, "Sector %u wall %u", surf->sectorno+1, s+1);
+        // Skipped tiles count as unchanged.
+        for(int t=0; t<surf->tiles; ++t) surf->differences += surf->texture->tiles[t].change;
+        surf->differences /= surf->tiles;
+        fprintf(stderr, "Differences in %s: %g\33[K\n", Buf, surf->differences);
+    }
+    // Done with this round, even if the bake is interrupted now.
+    surf->texture->record->round = round;
+}
 
-                if(round == 1)
-                {
-                    // Round 1: Check lightsources
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, vert[s].x*32768,vert[s+1].x*32768);
-                    struct Scaler txtz_int = Scaler_Init(0,0,1023, vert[s].y*32768,vert[s+1].y*32768);
-                    for(unsigned x=0; x<1024; ++x)
-                    {
-                        float txtx = Scaler_Next(&txtx_int)/32768.f;
-                        float txtz = Scaler_Next(&txtz_int)/32768.f;
-
-                        fprintf(stderr, "- Sector %u Wall %u/%u %u/%u diffuse light...\r", sectorno+1, s+1, sect->npoints, x,1024);
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, sect->ceil, txty, sect->floor);
-                            struct TextureSet* texture = &sect->uppertextures[s];
-
-                            if(sect->neighbors[s] >= 0 && txty < hole_high)
-                            {
-                                if(txty > hole_low) continue;
-                                texture = &sect->lowertextures[s];
-                            }
-
-                            struct xyz point_in_wall = { txtx, txty, txtz };
-                            DiffuseLightCalculation(normal, tangent, bitangent, texture, x,y, x,y,
-                                                    point_in_wall, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
-                    End_Diffuse(&sect->uppertextures[s]);
-                    End_Diffuse(&sect->lowertextures[s]);
-                }
-                else
-                {
-                    Begin_Radiosity(&sect->uppertextures[s]);
-                    Begin_Radiosity(&sect->lowertextures[s]);
+static void BakeWorker(struct JobQueue* queues, unsigned self, unsigned num_workers, unsigned round)
+{
+    for(;;)
+    {
+        unsigned job;
+        if(!PopJob(&queues[self], &job))
+        {
+            // Nothing left of our own, look for a victim. If everyone's queue
+            // is empty, the remaining jobs are already being worked on.
+            int stolen = 0;
+            for(unsigned n=1; n<num_workers && !stolen; ++n)
+                stolen = StealJobs(&queues[(self+n) % num_workers], &queues[self]);
+            if(!stolen) break;
+            continue;
+        }
 
-                    // Round 2+: Radiosity
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, vert[s].x*32768,vert[s+1].x*32768);
-                    struct Scaler txtz_int = Scaler_Init(0,0,1023, vert[s].y*32768,vert[s+1].y*32768);
-                    for(unsigned x=0; x<1024; ++x)
-                    {
-                        float txtx = Scaler_Next(&txtx_int)/32768.f;
-                        float txtz = Scaler_Next(&txtz_int)/32768.f;
-
-                        fprintf(stderr, "- Sector %u Wall %u/%u %u/%u radiosity...\r", sectorno+1, s+1, sect->npoints, x,1024);
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0,y,1024, sect->ceil, txty, sect->floor);
-                            struct TextureSet* texture = &sect->uppertextures[s];
-
-                            if(sect->neighbors[s] >= 0 && txty < hole_high)
-                            {
-                                if(txty > hole_low) continue;
-                                texture = &sect->lowertextures[s];
-                            }
-                            struct xyz point_in_wall = { txtx, txty, txtz };
-                            RadiosityCalculation(normal, tangent, bitangent, texture, x,y, x,y, point_in_wall, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
+        struct BakeSurface* surf = &bake_surfaces[bake_jobs[job].surface];
+        float change = BakeTile(&bake_jobs[job], round);
+        TileAt(surf->texture, bake_jobs[job].x, bake_jobs[job].y) = (struct TileRecord) { round, change };
 
-                    char Buf[128];
-                    sprintf(Buf, "Sector %u wall %u lower texture", sectorno+1, s+1); sector_differences += End_Radiosity(&sect->uppertextures[s], Buf);
-                    sprintf(Buf, "Sector %u wall %u upper texture", sectorno+1, s+1); sector_differences += End_Radiosity(&sect->lowertextures[s], Buf);
-                }
-                fprintf(stderr, "\n");
+        unsigned done = __atomic_add_fetch(&bake_jobs_done, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "- Round %u: %u/%u tiles, sector %u %s...\r", round, done,NumBakeJobs, surf->sectorno+1,
+                round == 1 ? "diffuse light" : "radiosity");
+
+        if(__atomic_sub_fetch(&surf->tiles_left, 1, __ATOMIC_ACQ_REL) == 0)
+            FinishSurface(surf, round);
+    }
+}
+
+/* My lightmap calculation involves some raytracing.
+ * There are faster ways to do it, but this is the only way I know how to do it in software.
+ */
+static void BuildLightmaps(int rebuild)
+{
+    CreateBakeSurfaces();
+    if(rebuild)
+        for(unsigned n=0; n<NumBakeSurfaces; ++n)
+            ResetSurface(&bake_surfaces[n]);
+
+    // Every round shoots the same rays, so that the rounds converge instead of
+    // trading one pattern of noise for another, and a resumed bake gets the same
+    // rays as an uninterrupted one.
+
+    // Create uniformly distributed random unit vectors
+    for(unsigned n=0; n<nrandomvectors; ++n)
+    {
+        double u = (rand() % 1000000) / 1e6; // 0..1
+        double v = (rand() % 1000000) / 1e6; // 0..1
+        double theta = 2*3.141592653*u;
+        double phi   = acos(2*v-1);
+        tvec[n].x = cos(theta) * sin(phi);
+        tvec[n].y = sin(theta) * sin(phi);
+        tvec[n].z = cos(phi);
+    }
+
+    // A lightsource is represented by a spherical cloud
+    // of smaller lightsources around the actual lightsource.
+    // This achieves smooth edges for the shadows.
+    #define drand(m) ((rand()%1000-500)*5e-2*m)
+    for(unsigned qa=0; qa<narealightcomponents; ++qa)
+    {
+        double len;
+        do {
+          avec[qa] = (struct xyz){ drand(100.0), drand(100.0), drand(100.0) };
+          len = sqrt(avec[qa].x*avec[qa].x + avec[qa].y*avec[qa].y + avec[qa].z*avec[qa].z);
+        } while(len < 1e-3);
+        avec[qa].x *= area_light_radius/len;
+        avec[qa].y *= area_light_radius/len;
+        avec[qa].z *= area_light_radius/len;
+    }
+    #undef drand
+
+    for(unsigned round=1; round<=maxrounds; ++round)
+    {
+        unsigned pending = QueueBakeJobs(round);
+        if(pending == 0) continue;
+        if(NumBakeJobs == 0)
+        {
+            // Every tile has converged. More rounds would not change anything.
+            for(unsigned n=0; n<NumBakeSurfaces; ++n)
+            {
+                struct BakeSurface* surf = &bake_surfaces[n];
+                for(int t=0; t<surf->tiles; ++t)
+                    if(surf->texture->tiles[t].round == round)
+                        surf->texture->tiles[t].round = maxrounds;
+                if(surf->texture->record->round == round)
+                    surf->texture->record->round = maxrounds;
             }
+            fprintf(stderr, "Lighting calculation converged after %u rounds.\n", round-1);
+            break;
+        }
+
+        fprintf(stderr, "Lighting calculation, round %u: %u tiles of up to %ux%u texels, %u converged tiles skipped...\n",
+            round, NumBakeJobs, TileSize,TileSize, pending - NumBakeJobs);
+#ifndef _OPENMP
+        fprintf(stderr, "Note: This would probably go faster if you enabled OpenMP in your compiler options. It's -fopenmp in GCC and Clang.\n");
+#endif
+
+        fprintf(stderr, "Note: You can interrupt this program at any time you want. The next time it starts,\n"
+                        "      it resumes the lightmap calculation from the last round each tile finished.\n"
+                        "      When the map is edited, only the surfaces that the edit affects are calculated\n"
+                        "      again. To calculate everything from the beginning, use the --rebuild commandline option.\n");
+
+#ifdef _OPENMP
+        unsigned num_workers = omp_get_max_threads();
+#else
+        unsigned num_workers = 1;
+#endif
+        // Deal the jobs out in contiguous ranges; stealing evens out the rest.
+        struct JobQueue* queues = calloc(num_workers, sizeof(*queues));
+        for(unsigned n=0; n<num_workers; ++n)
+            queues[n].range = JobRange((unsigned long long)NumBakeJobs * n / num_workers,
+                                       (unsigned long long)NumBakeJobs * (n+1) / num_workers);
+        bake_jobs_done = 0;
+
+#ifdef _OPENMP
+        #pragma omp parallel num_threads(num_workers)
+        BakeWorker(queues, omp_get_thread_num(), num_workers, round);
+#else
+        BakeWorker(queues, 0, num_workers, round);
+#endif
+        free(queues);
+        fprintf(stderr, "\n");
+
+        double total_differences = 0;
+        for(unsigned sectorno=0, n=0; sectorno<NumSectors; ++sectorno)
+        {
+            double sector_differences = 0;
+            for(; n<NumBakeSurfaces && bake_surfaces[n].sectorno == sectorno; ++n)
+                sector_differences += bake_surfaces[n].differences;
 
             fprintf(stderr, "Round %u differences in sector %u: %g\n", round, sectorno+1, sector_differences);
             total_differences += sector_differences;
         }
 
         fprintf(stderr, "Round %u differences total: %g.\n", round, total_differences);
-        if(total_differences < 1e-6)
-        {
-            break;
-        }
     }
 }
 #endif
@@ -1572,24 +2480,157 @@ static void MovePlayer(float dx, float dy)
 }
 
 #ifdef TextureMapping
-static void vline2(int x, int y1,int y2, struct Scaler ty,unsigned txtx, const struct TextureSet* t)
+/* MipLevel: The mip level for drawing a texture where one pixel spans this many
+ * texels across and down. The longer side decides. A distant surface reads a small
+ * mip level that stays in the cache, instead of striding through the full texture.
+ */
+static unsigned MipLevel(float across, float down)
+{
+    float texels_per_pixel = max(fabsf(across), fabsf(down));
+    // floor(log2()) of the whole texels is that of texels_per_pixel.
+    unsigned texels = min(texels_per_pixel, 1 << (MipLevels-1));
+    return texels > 1 ? 31 - __builtin_clz(texels) : 0;
+}
+// TextureColumn: The column u (0-1023) of a texture in mip level L, to be indexed by v >> L.
+#define TextureColumn(set, level, u) ((set)->mips[level] + ((u) >> (level)) * (1024 >> (level)))
+
+static void vline2(int x, int y1,int y2, struct Scaler ty,unsigned txtx, unsigned level, const struct TextureSet* t)
 {
     int *pix = (int*) surface->pixels;
     y1 = clamp(y1, 0, H-1);
     y2 = clamp(y2, 0, H-1);
     pix += y1 * W2 + x;
 
+    const int* column = TextureColumn(t, level, txtx % 1024);
     for(int y = y1; y <= y2; ++y)
     {
         unsigned txty = Scaler_Next(&ty);
   #ifdef LightMapping
-        *pix = ApplyLight( t->texture[txtx % 1024][txty % 1024], t->lightmap[txtx % 1024][txty % 1024] );
+        *pix = ApplyLight( column[(txty % 1024) >> level], LightmapSample(t, txtx % 1024, txty % 1024) );
   #else
-        *pix = t->texture[txtx % 1024][txty % 1024];
+        *pix = column[(txty % 1024) >> level];
   #endif
         pix += W2;
     }
 }
+
+/* Visplanes: While the walls are drawn, the rows of floor and ceiling in each column
+ * are only recorded, grouped by sector. Once the walls are done, the columns are turned
+ * into horizontal spans, like in Doom. Everything along a span is at the same depth,
+ * so a span takes one division, and the map coordinates step linearly across it.
+ */
+#define MaxVisplanes 128
+#define NoColumn     0xFFFF
+static struct visplane
+{
+    unsigned short sectorno, ceiling;
+    short minx, maxx;
+    unsigned short top[W], bottom[W]; // Rows covered in each column. top is NoColumn (and bottom 0) if none.
+} visplanes[MaxVisplanes];
+static unsigned NumVisplanes = 0;
+
+static void DrawSpan(const struct visplane* p, int y, int x1, int x2)
+{
+    const struct sector* sect = &sectors[p->sectorno];
+    const struct TextureSet* txt = p->ceiling ? sect->ceiltexture : sect->floortexture;
+    float hei = (p->ceiling ? sect->ceil : sect->floor) - player.where.z;
+    float pcos = player.anglecos, psin = player.anglesin;
+    // The mip level depends on the depth only. One pixel across is depth/(W*hfov) map units,
+    // and one pixel down is depth²/(hei*H*vfov), at 256 texels per map unit.
+    float depth = hei*H*vfov / ((H/2 - y) - player.yaw*H*vfov);
+    unsigned level = MipLevel(256 * depth / (W*hfov), 256 * depth*depth / (hei*H*vfov));
+    // Map coordinates at x1 (see CeilingFloorScreenCoordinatesToMapCoordinates), and their change per pixel.
+    float across = depth / (W*hfov), vx = across * (W/2 - x1);
+    float mapx = depth * pcos + vx * psin + player.where.x, dx = -across * psin;
+    float mapz = depth * psin - vx * pcos + player.where.y, dz =  across * pcos;
+    // Stepped in 16.16 fixed point. The integer part wraps at a multiple of 1024, so it stays right modulo 1024.
+    #define Fixed(v) ((unsigned)(long long)((v) * 65536.f))
+    unsigned u = Fixed(mapx * 256), du = Fixed(dx * 256);
+    unsigned v = Fixed(mapz * 256), dv = Fixed(dz * 256);
+  #ifdef LightMapping
+    const struct SectorAccel* acc = &sector_accel[p->sectorno];
+    float lscalex = 1024 / (acc->bounding_max.x - acc->bounding_min.x);
+    float lscalez = 1024 / (acc->bounding_max.y - acc->bounding_min.y);
+    unsigned lu = Fixed((mapx - acc->bounding_min.x) * lscalex), dlu = Fixed(dx * lscalex);
+    unsigned lv = Fixed((mapz - acc->bounding_min.y) * lscalez), dlv = Fixed(dz * lscalez);
+  #endif
+    #undef Fixed
+
+    int* pix = (int*)surface->pixels + y*W2 + x1;
+    for(int x = x1; x <= x2; ++x)
+    {
+        unsigned txtx = (u >> 16) % 1024, txtz = (v >> 16) % 1024;
+  #ifdef LightMapping
+        *pix++ = ApplyLight( TextureColumn(txt, level, txtx)[txtz >> level],
+                             LightmapSample(txt, (lu >> 16) % 1024, (lv >> 16) % 1024) );
+        lu += dlu; lv += dlv;
+  #else
+        *pix++ = TextureColumn(txt, level, txtz)[txtx >> level];
+  #endif
+        u += du; v += dv;
+    }
+}
+
+static void DrawVisplanes(void)
+{
+    static short spanstart[H];
+    for(unsigned n = 0; n < NumVisplanes; ++n)
+    {
+        const struct visplane* p = &visplanes[n];
+        // Compare each column to the previous one. Rows that the previous one
+        // covered but this one does not end a span; the opposite begins one.
+        for(int x = p->minx; x <= p->maxx+1; ++x)
+        {
+            int t1 = x > p->minx  ? p->top[x-1] : NoColumn, b1 = x > p->minx  ? p->bottom[x-1] : 0;
+            int t2 = x <= p->maxx ? p->top[x]   : NoColumn, b2 = x <= p->maxx ? p->bottom[x]   : 0;
+            for(; t1 < t2 && t1 <= b1; ++t1) DrawSpan(p, t1, spanstart[t1], x-1);
+            for(; b1 > b2 && b1 >= t1; --b1) DrawSpan(p, b1, spanstart[b1], x-1);
+            for(; t2 < t1 && t2 <= b2; ++t2) spanstart[t2] = x;
+            for(; b2 > b1 && b2 >= t2; --b2) spanstart[b2] = x;
+        }
+    }
+    NumVisplanes = 0;
+}
+
+/* AddToVisplane: Record rows top..bottom of column x as floor or ceiling of the given sector.
+ * p is the visplane used for the previous column, or NULL. Returns the visplane used.
+ */
+static struct visplane* AddToVisplane(struct visplane* p, unsigned sectorno, unsigned ceiling, int x, int top, int bottom)
+{
+    if(top > bottom) return p;
+    // p may be stale, if the planes were drawn and reused since.
+    if(p && (p >= visplanes+NumVisplanes || p->sectorno != sectorno || p->ceiling != ceiling)) p = NULL;
+    if(p && p->top[x] != NoColumn)
+    {
+        // The column between two walls is visited twice. Merge, if the rows meet.
+        if(top <= p->bottom[x]+1 && bottom+1 >= p->top[x])
+        {
+            p->top[x]    = min(p->top[x], top);
+            p->bottom[x] = max(p->bottom[x], bottom);
+            return p;
+        }
+        p = NULL;
+    }
+    // Find a plane of this sector that does not cover this column yet.
+    for(unsigned n = 0; !p && n < NumVisplanes; ++n)
+        if(visplanes[n].sectorno == sectorno && visplanes[n].ceiling == ceiling && visplanes[n].top[x] == NoColumn)
+            p = &visplanes[n];
+    if(!p)
+    {
+        if(NumVisplanes == MaxVisplanes) DrawVisplanes(); // Out of planes. Their pixels can be drawn early.
+        p = &visplanes[NumVisplanes++];
+        p->sectorno = sectorno;
+        p->ceiling  = ceiling;
+        p->minx = W; p->maxx = -1;
+        memset(p->top,    0xFF, sizeof(p->top));
+        memset(p->bottom, 0,    sizeof(p->bottom));
+    }
+    p->top[x]    = top;
+    p->bottom[x] = bottom;
+    p->minx = min(p->minx, x);
+    p->maxx = max(p->maxx, x);
+    return p;
+}
 #endif
 
 static void DrawScreen(void)
@@ -1626,10 +2667,9 @@ static void DrawScreen(void)
 #endif
         /* Render each wall of this sector that is facing towards player. */
         const struct sector* const sect = &sectors[now.sectorno];
-  #ifdef LightMapping
-        struct xy bounding_min = {1e9f, 1e9f}, bounding_max = {-1e9f, -1e9f};
-        GetSectorBoundingBox(now.sectorno, &bounding_min, &bounding_max);
-  #endif
+#ifdef TextureMapping
+        struct visplane *ceilplane = NULL, *floorplane = NULL;
+#endif
 
         /* This loop can be used to illustrate currently rendering window. Should be disabled otherwise. */
         //for(unsigned x=now.sx1; x<=now.sx2; ++x)
@@ -1722,7 +2762,8 @@ static void DrawScreen(void)
                 //    txtx  : u0*z1*(x2-x) + u1*z0*(x-x1)
                 //          / ((x2-x)*z1 + (x-x1)*z0);
 #ifdef TextureMapping
-                int txtx = (u0*((x2-x)*tz2) + u1*((x-x1)*tz1)) / ((x2-x)*tz2 + (x-x1)*tz1);
+                float udiv = (x2-x)*tz2 + (x-x1)*tz1;
+                int txtx = (u0*((x2-x)*tz2) + u1*((x-x1)*tz1)) / udiv;
 #endif
 #if defined(DepthShading) && !defined(TextureMapping)
                 /* Calculate the Z coordinate for this point. (Only used for lighting.) */
@@ -1734,6 +2775,12 @@ static void DrawScreen(void)
                 /* Clamp the ya & yb */
                 int cya = clamp(ya, ytop[x],ybottom[x]);
                 int cyb = clamp(yb, ytop[x],ybottom[x]);
+#ifdef TextureMapping
+                // The derivative of txtx by x, and 1024 texels down the wall's
+                // height, choose the mip level for this column of the wall.
+                float dudx = (u1-u0) * tz1*tz2 * (x2-x1) / (udiv*udiv);
+                unsigned level = MipLevel(dudx, 1024.f / max(yb-ya, 1));
+#endif
 
                 // Our perspective calculation produces these two:
                 //     screenX = W/2 + -mapX              * (W*hfov) / mapZ
@@ -1765,31 +2812,11 @@ static void DrawScreen(void)
                     } while(0)
 
 #ifdef TextureMapping
-                // Texture-mapping for floors and ceilings is not very optimal in my program.
-                // I'm converting each screen-pixel into map-coordinates by doing the perspective
-                // transformation in reverse, and using these map-coordinates as indexes into texture.
-                // This involves a few division calculations _per_ pixel, and would have been way
-                // too slow for the platforms targeted by Doom and Duke3D.
-                // In any case, there's no neat way to do it.
-                // It is why the SNES port of Doom didn't do floor & ceiling textures at all.
-                for(int y=ytop[x]; y<=ybottom[x]; ++y)
-                {
-                    if(y >= cya && y <= cyb) { y = cyb; continue; }
-                    float hei = y < cya ? yceil    : yfloor;
-                    float mapx, mapz;
-                    CeilingFloorScreenCoordinatesToMapCoordinates(hei, x,y,  mapx,mapz);
-                    unsigned txtx = (mapx * 256), txtz = (mapz * 256);
-                    const struct TextureSet* txt = y < cya ? sect->ceiltexture : sect->floortexture;
-  #ifdef LightMapping
-                    unsigned lu = ((unsigned)((mapx - bounding_min.x) * 1024 / (bounding_max.x - bounding_min.x))) % 1024;
-                    unsigned lv = ((unsigned)((mapz - bounding_min.y) * 1024 / (bounding_max.y - bounding_min.y))) % 1024;
-                    int pel = ApplyLight( txt->texture[txtx % 1024][txtz % 1024],
-                                          txt->lightmap[lu][lv] );
-  #else
-                    int pel = txt->texture[txtz % 1024][txtx % 1024];
-  #endif
-                    ((int*)surface->pixels)[y*W2+x] = pel;
-                }
+                // Floors and ceilings are drawn after the walls, a row at a time. See DrawVisplanes().
+                // Doing the perspective transformation in reverse for each pixel would take
+                // a few divisions _per_ pixel.
+                ceilplane  = AddToVisplane(ceilplane,  now.sectorno, 1, x, ytop[x], cya-1);
+                floorplane = AddToVisplane(floorplane, now.sectorno, 0, x, max(cya, cyb+1), ybottom[x]);
 #else
                 /* Render ceiling: everything above this sector's ceiling height. */
                 vline(x, ytop[x], cya-1, 0x111111 ,0x222222,0x111111);
@@ -1832,7 +2859,7 @@ static void DrawScreen(void)
                     int cnyb = clamp(nyb, ytop[x],ybottom[x]);
                     /* If our ceiling is higher than their ceiling, render upper wall */
 #ifdef TextureMapping
-                    vline2(x, cya, cnya-1, (struct Scaler)Scaler_Init(ya,cya,yb, 0,1023), txtx, &sect->uppertextures[s]);
+                    vline2(x, cya, cnya-1, (struct Scaler)Scaler_Init(ya,cya,yb, 0,1023), txtx, level, &sect->uppertextures[s]);
 #else
   #ifdef DepthShading
                     unsigned r1 = 0x010101 * (255-z), r2 = 0x040007 * (31-z/8);
@@ -1845,7 +2872,7 @@ static void DrawScreen(void)
 
                     // If our floor is lower than their floor, render bottom wall
 #ifdef TextureMapping
-                    vline2(x, cnyb+1, cyb, (struct Scaler)Scaler_Init(ya,cnyb+1,yb, 0,1023), txtx, &sect->lowertextures[s]);
+                    vline2(x, cnyb+1, cyb, (struct Scaler)Scaler_Init(ya,cnyb+1,yb, 0,1023), txtx, level, &sect->lowertextures[s]);
 #else
                     vline(x, cnyb+1, cyb, 0, x==x1||x==x2 ? 0 : r2, 0);
 #endif
@@ -1860,7 +2887,7 @@ static void DrawScreen(void)
                 {
                     /* There's no neighbor. Render wall. */
 #ifdef TextureMapping
-                    vline2(x, cya,cyb, (struct Scaler)Scaler_Init(ya,cya,yb, 0,1023), txtx, &sect->uppertextures[s]);
+                    vline2(x, cya,cyb, (struct Scaler)Scaler_Init(ya,cya,yb, 0,1023), txtx, level, &sect->uppertextures[s]);
 #else
   #ifdef DepthShading
                     unsigned r = 0x010101 * (255-z);
@@ -1891,6 +2918,9 @@ static void DrawScreen(void)
         NumVisibleSectors += 1;
 #endif
     }
+#ifdef TextureMapping
+    DrawVisplanes();
+#endif
 
     SDL_UnlockSurface(surface);
     SaveFrame2();
@@ -1902,11 +2932,13 @@ int main(int argc, char** argv)
 {
     LoadData();
     VerifyMap();
+#if defined(TextureMapping) && defined(LightMapping)
+    BuildSectorAccel();
+#endif
 #ifdef TextureMapping
-    int textures_initialized = LoadTexture();
+    LoadTexture();
   #ifdef LightMapping
-    if(textures_initialized || (argc > 1 && strcmp(argv[1], "--rebuild") == 0))
-        BuildLightmaps();
+    BuildLightmaps(argc > 1 && strcmp(argv[1], "--rebuild") == 0);
   #endif
 #endif
 
@@ -2053,6 +3085,9 @@ int main(int argc, char** argv)
         SDL_Delay(10);
     }
 done:
+#if defined(TextureMapping) && defined(LightMapping)
+    UnloadSectorAccel();
+#endif
     UnloadData();
     SDL_Quit();
     return 0;
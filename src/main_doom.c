@@ -186,7 +186,7 @@ static int load_sectors(const char *path) {
     int retval = 0;
 
     enum {
-        SCAN_SECTOR, SCAN_WALL, SCAN_NONE
+        SCAN_SECTOR, SCAN_WALL, SCAN_SKIP, SCAN_NONE
     } ss = SCAN_NONE;
 
     char line[1024], buf[64];
@@ -209,6 +209,8 @@ static int load_sectors(const char *path) {
                 if (!strcmp(section, "SECTOR")) ss = SCAN_SECTOR;
                 else if (!strcmp(section, "WALL")) {
                     ss = SCAN_WALL;
+                } else if (!strcmp(section, "MOVER")) {
+                    ss = SCAN_SKIP; // movers are only supported by main_doom.cpp
                 } else {
                     retval = -3;
                     goto done;
@@ -245,6 +247,7 @@ static int load_sectors(const char *path) {
                             goto done;
                         } // invalid sector data format
                     } break;
+                    case SCAN_SKIP: break;
                     default: retval = -6; // parsing data out of recognized section
                         goto done;
                 }
@@ -3,12 +3,20 @@
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 // SDL2 includes
 #include <SDL2/SDL.h>
 
+// Dear ImGui, only used by the performance HUD
+#include "imgui.h"
+#include "imgui_impl_sdl2.h"
+#include "imgui_impl_sdlrenderer2.h"
+
 #define ASSERT(_e, ...)                                                        \
   if (!(_e)) {                                                                 \
     fprintf(stderr, __VA_ARGS__);                                              \
@@ -50,6 +58,48 @@ constexpr f32 VFOV = 0.5f;
 constexpr f32 ZNEAR = 0.0001f;
 constexpr f32 ZFAR = 128.0f;
 
+// columns re-rendered next to newly exposed ones when reprojecting, and which
+// share of the columns may be missing from the key frame before a new one is
+// rendered
+constexpr int REPROJECT_GUARD = 4;
+constexpr f32 REPROJECT_MAX_MISSING = 0.25f;
+
+// half-rate rendering draws every second column (interlaced) or pixel
+// (checkerboard) per frame. the gaps are taken from the previous frame unless
+// the camera moved more than this per frame, then neighbors are blended
+constexpr f32 HALFRATE_FAST_MOVE = 0.01f;
+constexpr f32 HALFRATE_FAST_TURN = 0.005f;
+
+enum class HalfRate { Off, Interlaced, Checkerboard };
+
+// how screen angles map to columns. perspective is the original tan based
+// mapping, equiangular spaces angles evenly across the screen
+enum class Projection { Perspective, Equiangular };
+
+enum class PresentMode { Vsync, Immediate };
+
+// renderer settings which can be changed at runtime from the HUD
+struct Tuning {
+  f32 render_scale; // render resolution relative to SCREEN_WIDTH/HEIGHT
+  int threads;      // vertical strips rendered in parallel
+  Projection projection;
+  PresentMode present;
+};
+
+constexpr int MAX_THREADS = 16;
+
+// renderer counters of one frame
+struct RenderStats {
+  int sectors, walls, columns;
+  i64 pixels;
+};
+
+// zones timed by the HUD's profiler
+enum Zone { ZONE_INPUT, ZONE_UPDATE, ZONE_HUD, ZONE_RENDER, ZONE_PRESENT, ZONE_COUNT };
+constexpr const char *ZONE_NAMES[ZONE_COUNT] = {"input", "update", "hud",
+                                                "render", "present"};
+constexpr int PROFILE_FRAMES = 240;
+
 const char *LEVEL_FILE = "res/level.txt";
 
 struct v2 {
@@ -140,6 +190,31 @@ struct Sector {
   f32 zfloor, zceil;
 };
 
+// doors move the ceiling, lifts move the floor, crushers move the ceiling
+// back and forth until they are stopped again
+enum class MoverKind { Door, Lift, Crusher };
+
+struct Mover {
+  int sector;
+  MoverKind kind;
+  f32 lo, hi;  // travel range of the moving plane
+  f32 speed;   // units per second
+  int dir;     // -1 lowering, +1 raising, 0 idle
+};
+
+// derived per-wall data, only recomputed when one of the two sectors the wall
+// touches is marked dirty
+struct WallCache {
+  int shade;
+  f32 nz_floor, nz_ceil; // heights of the sector behind a portal
+  bool open;             // portal has a gap which can be looked through
+};
+
+// derived per-sector data, heights relative to the eye
+struct SectorCache {
+  f32 floor_eye, ceil_eye;
+};
+
 struct GlobalState {
   SDL_Window *window;
   SDL_Renderer *renderer;
@@ -157,6 +232,29 @@ struct GlobalState {
     usize n;
   } walls;
 
+  struct {
+    Mover arr[32];
+    usize n;
+  } movers;
+
+  struct {
+    WallCache walls[128];
+    SectorCache sectors[32];
+
+    // walls of other sectors which portal into sector i are
+    // refs[first[i]..first[i + 1]]
+    usize first[32 + 1];
+    usize refs[128];
+
+    // sectors whose heights changed since the last flush
+    int dirty[32];
+    bool is_dirty[32];
+    usize ndirty;
+
+    // bumped every time derived data changes, so frame caches can tell
+    u32 version;
+  } derived;
+
   u16 y_lo[SCREEN_WIDTH], y_hi[SCREEN_WIDTH];
 
   struct {
@@ -169,6 +267,45 @@ struct GlobalState {
     bool mode;
   } dev;
 
+  // last fully rendered frame (key frame), reprojected while the camera only
+  // rotates. always reprojecting from the key frame keeps rounding errors
+  // from adding up over several frames
+  struct {
+    u32 *pixels;
+    bool valid;
+    v2 pos;
+    f32 angle;
+    int sector;
+    u32 version;
+    int chain;  // frames reprojected from this key frame
+    int reused; // columns reprojected in the last frame
+    bool disabled; // always render full frames, the benchmark's baseline
+  } history;
+
+  struct {
+    HalfRate mode;
+    int parity; // which columns/pixels are drawn this frame
+  } halfrate;
+
+  // render resolution, SCREEN_WIDTH x SCREEN_HEIGHT scaled by the tuning
+  int w, h;
+  Tuning tuning;
+  RenderStats stats;
+
+  // frame and zone timings, only recorded while the HUD is open
+  struct {
+    f32 frame_ms[PROFILE_FRAMES];
+    f32 zone_ms[ZONE_COUNT][PROFILE_FRAMES];
+    int head;
+    u64 frame_start, zone_start;
+  } profile;
+
+  struct {
+    bool open;
+    bool initialized; // ImGui is only set up the first time the HUD opens
+    bool pending;     // a HUD frame was built and still has to be drawn
+  } hud;
+
   bool sleepy;
 };
 
@@ -176,10 +313,22 @@ static GlobalState state; // global instance
 
 // convert angle in [-(HFOV / 2)..+(HFOV / 2)] to X coordinate
 static int screen_angle_to_x(const f32 angle) {
-  return SCREEN_WIDTH / 2 *
+  if (state.tuning.projection == Projection::Equiangular)
+    return state.w / 2 * (1.0f - angle / (HFOV / 2.0f));
+
+  return state.w / 2 *
          (1.0f - std::tan((angle + HFOV / 2.0f) / HFOV * PI_2 - PI_4));
 }
 
+// inverse of screen_angle_to_x, angle at the center of column x
+static f32 screen_x_to_angle(const int x) {
+  const f32 u = 1.0f - 2.0f * (x + 0.5f) / state.w;
+  if (state.tuning.projection == Projection::Equiangular)
+    return u * (HFOV / 2.0f);
+
+  return (std::atan(u) + PI_4) / PI_2 * HFOV - HFOV / 2.0f;
+}
+
 // normalize angle to +/-PI
 static f32 normalize_angle(const f32 a) {
   return a - TAU * std::floor((a + PI) / TAU);
@@ -201,6 +350,7 @@ static int load_sectors(const char *path) {
   // sector 0 does not exist
   state.sectors.n = 1;
   state.walls.n = 0; // initialize walls count
+  state.movers.n = 0;
 
   FILE *f = fopen(path, "r");
   if (!f)
@@ -211,6 +361,7 @@ static int load_sectors(const char *path) {
   enum ScanState { // renamed enum
     SCAN_SECTOR,
     SCAN_WALL,
+    SCAN_MOVER,
     SCAN_NONE
   };
   ScanState ss = SCAN_NONE;
@@ -241,6 +392,8 @@ static int load_sectors(const char *path) {
           ss = SCAN_SECTOR;
         else if (!strcmp(section, "WALL")) {
           ss = SCAN_WALL;
+        } else if (!strcmp(section, "MOVER")) {
+          ss = SCAN_MOVER;
         } else {
           retval = -3; // unknown section
           goto done;
@@ -273,6 +426,31 @@ static int load_sectors(const char *path) {
             goto done;
           }
         } break;
+        case SCAN_MOVER: {
+          if (state.movers.n >=
+              sizeof(state.movers.arr) / sizeof(state.movers.arr[0])) {
+            retval = -9; // too many movers
+            goto done;
+          }
+          Mover *mover = &state.movers.arr[state.movers.n++];
+          char kind[16];
+          if (sscanf(p, "%d %15s %f %f %f", &mover->sector, kind, &mover->lo,
+                     &mover->hi, &mover->speed) != 5) {
+            retval = -10; // invalid mover data format
+            goto done;
+          }
+          if (!strcmp(kind, "DOOR"))
+            mover->kind = MoverKind::Door;
+          else if (!strcmp(kind, "LIFT"))
+            mover->kind = MoverKind::Lift;
+          else if (!strcmp(kind, "CRUSHER"))
+            mover->kind = MoverKind::Crusher;
+          else {
+            retval = -11; // unknown mover kind
+            goto done;
+          }
+          mover->dir = 0;
+        } break;
         default:
           retval = -6; // parsing data out of recognized section
           goto done;
@@ -281,16 +459,180 @@ static int load_sectors(const char *path) {
 	}
   }
 
-  if (ferror(f))
+  if (ferror(f)) {
     retval = -128; // file read error
+    goto done;
+  }
+
+  // [MOVER] may come before [SECTOR], so check the sectors once all are read
+  for (usize i = 0; i < state.movers.n; i++) {
+    const int sector = state.movers.arr[i].sector;
+    if (sector < 1 || sector >= static_cast<int>(state.sectors.n)) {
+      retval = -12; // mover of a sector that does not exist
+      goto done;
+    }
+  }
 done:
   fclose(f);
   return retval;
 }
 
-static void verline(const int x, const int y0, const int y1, const u32 color) {
+static void update_wall_cache(usize i) {
+  const Wall *wall = &state.walls.arr[i];
+  WallCache *wc = &state.derived.walls[i];
+
+  // for a quick port, using the original logic even if it seems odd:
+  wc->shade =
+      16 * (std::sin(std::atan2(static_cast<f32>(wall->b.x - wall->a.x),
+                                static_cast<f32>(wall->b.y - wall->a.y))) +
+            1.0f);
+
+  if (wall->portal == SECTOR_NONE) {
+    wc->nz_floor = wc->nz_ceil = 0;
+    wc->open = false;
+    return;
+  }
+
+  const Sector *neighbor = &state.sectors.arr[wall->portal];
+  wc->nz_floor = neighbor->zfloor;
+  wc->nz_ceil = neighbor->zceil;
+  wc->open = neighbor->zceil > neighbor->zfloor;
+}
+
+static void update_sector_cache(int id) {
+  const Sector *sector = &state.sectors.arr[id];
+  SectorCache *sc = &state.derived.sectors[id];
+  sc->floor_eye = sector->zfloor - EYE_Z;
+  sc->ceil_eye = sector->zceil - EYE_Z;
+}
+
+// build derived data for the whole level, only needed after loading
+static void build_derived() {
+  usize counts[32 + 1] = {0};
+  for (usize i = 0; i < state.walls.n; i++) {
+    if (state.walls.arr[i].portal != SECTOR_NONE)
+      counts[state.walls.arr[i].portal]++;
+  }
+
+  usize n = 0;
+  for (usize id = 0; id < state.sectors.n; id++) {
+    state.derived.first[id] = n;
+    n += counts[id];
+  }
+  state.derived.first[state.sectors.n] = n;
+
+  // counts are reused as per-sector fill cursors
+  std::fill(std::begin(counts), std::end(counts), 0);
+  for (usize i = 0; i < state.walls.n; i++) {
+    const int portal = state.walls.arr[i].portal;
+    if (portal != SECTOR_NONE)
+      state.derived.refs[state.derived.first[portal] + counts[portal]++] = i;
+  }
+
+  for (usize id = 0; id < state.sectors.n; id++)
+    update_sector_cache(id);
+  for (usize i = 0; i < state.walls.n; i++)
+    update_wall_cache(i);
+
+  state.derived.ndirty = 0;
+  std::fill(std::begin(state.derived.is_dirty), std::end(state.derived.is_dirty),
+            false);
+  state.derived.version++;
+}
+
+static void mark_sector_dirty(int id) {
+  if (state.derived.is_dirty[id])
+    return;
+  state.derived.is_dirty[id] = true;
+  state.derived.dirty[state.derived.ndirty++] = id;
+}
+
+// recompute derived data of dirty sectors, their own walls and the walls of
+// neighbors which look into them
+static void flush_dirty() {
+  if (state.derived.ndirty == 0)
+    return;
+
+  for (usize d = 0; d < state.derived.ndirty; d++) {
+    const int id = state.derived.dirty[d];
+    const Sector *sector = &state.sectors.arr[id];
+
+    update_sector_cache(id);
+    for (usize i = 0; i < sector->nwalls; i++)
+      update_wall_cache(sector->firstwall + i);
+    for (usize r = state.derived.first[id]; r < state.derived.first[id + 1];
+         r++)
+      update_wall_cache(state.derived.refs[r]);
+
+    state.derived.is_dirty[id] = false;
+  }
+
+  state.derived.ndirty = 0;
+  state.derived.version++;
+}
+
+// the plane a mover animates
+static f32 *mover_plane(const Mover *mover) {
+  Sector *sector = &state.sectors.arr[mover->sector];
+  return mover->kind == MoverKind::Lift ? &sector->zfloor : &sector->zceil;
+}
+
+// start or reverse movers in the camera's sector and its direct neighbors
+static void use_movers() {
+  const Sector *sector = &state.sectors.arr[state.camera.sector];
+
+  for (usize m = 0; m < state.movers.n; m++) {
+    Mover *mover = &state.movers.arr[m];
+
+    bool near = mover->sector == state.camera.sector;
+    for (usize i = 0; !near && i < sector->nwalls; i++)
+      near = state.walls.arr[sector->firstwall + i].portal == mover->sector;
+
+    if (!near)
+      continue;
+
+    if (mover->dir != 0 && mover->kind == MoverKind::Crusher) {
+      mover->dir = 0;
+    } else if (mover->dir != 0) {
+      mover->dir = -mover->dir;
+    } else {
+      mover->dir = *mover_plane(mover) > (mover->lo + mover->hi) / 2 ? -1 : 1;
+    }
+  }
+}
+
+// advance all movers by one tick, marking the sectors they touch as dirty
+static void update_movers(f32 dt) {
+  for (usize m = 0; m < state.movers.n; m++) {
+    Mover *mover = &state.movers.arr[m];
+    if (mover->dir == 0)
+      continue;
+
+    f32 *z = mover_plane(mover);
+    *z = std::clamp(*z + mover->dir * mover->speed * dt, mover->lo, mover->hi);
+
+    if (mover->dir < 0 ? *z == mover->lo : *z == mover->hi)
+      mover->dir = mover->kind == MoverKind::Crusher ? -mover->dir : 0;
+
+    mark_sector_dirty(mover->sector);
+  }
+
+  flush_dirty();
+}
+
+// returns the number of pixels written
+static int verline(const int x, const int y0, const int y1, const u32 color) {
+  if (state.halfrate.mode == HalfRate::Checkerboard) {
+    int n = 0;
+    for (int y = y0 + ((x + y0 + state.halfrate.parity) & 1); y <= y1;
+         y += 2, n++)
+      state.pixels[y * state.w + x] = color;
+    return n;
+  }
+
   for (int y = y0; y <= y1; y++)
-    state.pixels[y * SCREEN_WIDTH + x] = color;
+    state.pixels[y * state.w + x] = color;
+  return std::max(y1 - y0 + 1, 0);
 }
 
 // the point is in sector if it is on the left side of all walls
@@ -303,9 +645,16 @@ static bool point_in_sector(const Sector *sector, v2 p) {
   return true;
 }
 
-static void render() {
-  for (int i = 0; i < SCREEN_WIDTH; i++) {
-    state.y_hi[i] = SCREEN_HEIGHT - 1;
+// render screen columns [cx0..cx1] from scratch. every strip walks the
+// sectors and portal windows of the whole screen in the same order, and only
+// the drawing is clipped to the strip. each column only depends on what was
+// drawn in it before, so a strip looks exactly like the same columns of a full
+// render. strips do not share any state and can be rendered in parallel
+static RenderStats render_columns(const int cx0, const int cx1) {
+  RenderStats stats = {};
+
+  for (int i = cx0; i <= cx1; i++) {
+    state.y_hi[i] = state.h - 1;
     state.y_lo[i] = 0;
   }
 
@@ -329,7 +678,7 @@ static void render() {
   struct {
     QueueEntry arr[QUEUE_MAX];
     usize n;
-  } queue = {{{state.camera.sector, 0, SCREEN_WIDTH - 1}}, 1};
+  } queue = {{{state.camera.sector, 0, state.w - 1}}, 1};
 
   while (queue.n != 0) {
     QueueEntry entry = queue.arr[--queue.n];
@@ -338,6 +687,7 @@ static void render() {
       continue;
 
     sectdraw[entry.id] = true;
+    stats.sectors++;
 
     const Sector *sector = &state.sectors.arr[entry.id];
 
@@ -389,39 +739,43 @@ static void render() {
         continue;
       }
 
-      // for a quick port, using the original logic even if it seems odd:
-      const int wallshade =
-          16 * (std::sin(std::atan2(static_cast<f32>(wall->b.x - wall->a.x),
-                                    static_cast<f32>(wall->b.y - wall->a.y))) +
-                1.0f);
+      const WallCache *wc =
+          &state.derived.walls[sector->firstwall + i];
+      const int wallshade = wc->shade;
 
       const int x0 = std::clamp(tx0, entry.x0, entry.x1),
                 x1 = std::clamp(tx1, entry.x0, entry.x1);
 
-      const f32 z_floor = sector->zfloor, z_ceil = sector->zceil,
-                nz_floor = wall->portal != SECTOR_NONE
-                               ? state.sectors.arr[wall->portal].zfloor
-                               : 0,
-                nz_ceil = wall->portal != SECTOR_NONE
-                              ? state.sectors.arr[wall->portal].zceil
-                              : 0;
+      // the portal below is queued even if the wall is outside of the strip,
+      // which sector a portal reaches first must not depend on the strip
+      if (x1 >= cx0 && x0 <= cx1)
+        stats.walls++;
 
-      const f32 sy0 = ifnan((VFOV * SCREEN_HEIGHT) / cp0.y, 1e10f),
-                sy1 = ifnan((VFOV * SCREEN_HEIGHT) / cp1.y, 1e10f);
+      const SectorCache *sc = &state.derived.sectors[entry.id];
+      const f32 nz_floor = wc->nz_floor, nz_ceil = wc->nz_ceil;
+
+      const f32 sy0 = ifnan((VFOV * state.h) / cp0.y, 1e10f),
+                sy1 = ifnan((VFOV * state.h) / cp1.y, 1e10f);
 
       const int
-          yf0 = SCREEN_HEIGHT / 2 + static_cast<int>((z_floor - EYE_Z) * sy0),
-          yc0 = SCREEN_HEIGHT / 2 + static_cast<int>((z_ceil - EYE_Z) * sy0),
-          yf1 = SCREEN_HEIGHT / 2 + static_cast<int>((z_floor - EYE_Z) * sy1),
-          yc1 = SCREEN_HEIGHT / 2 + static_cast<int>((z_ceil - EYE_Z) * sy1),
-          nyf0 = SCREEN_HEIGHT / 2 + static_cast<int>((nz_floor - EYE_Z) * sy0),
-          nyc0 = SCREEN_HEIGHT / 2 + static_cast<int>((nz_ceil - EYE_Z) * sy0),
-          nyf1 = SCREEN_HEIGHT / 2 + static_cast<int>((nz_floor - EYE_Z) * sy1),
-          nyc1 = SCREEN_HEIGHT / 2 + static_cast<int>((nz_ceil - EYE_Z) * sy1),
+          yf0 = state.h / 2 + static_cast<int>(sc->floor_eye * sy0),
+          yc0 = state.h / 2 + static_cast<int>(sc->ceil_eye * sy0),
+          yf1 = state.h / 2 + static_cast<int>(sc->floor_eye * sy1),
+          yc1 = state.h / 2 + static_cast<int>(sc->ceil_eye * sy1),
+          nyf0 = state.h / 2 + static_cast<int>((nz_floor - EYE_Z) * sy0),
+          nyc0 = state.h / 2 + static_cast<int>((nz_ceil - EYE_Z) * sy0),
+          nyf1 = state.h / 2 + static_cast<int>((nz_floor - EYE_Z) * sy1),
+          nyc1 = state.h / 2 + static_cast<int>((nz_ceil - EYE_Z) * sy1),
           txd = tx1 - tx0, yfd = yf1 - yf0, ycd = yc1 - yc0, nyfd = nyf1 - nyf0,
           nycd = nyc1 - nyc0;
 
-      for (int x = x0; x <= x1; x++) {
+      for (int x = std::max(x0, cx0); x <= std::min(x1, cx1); x++) {
+        if (state.halfrate.mode == HalfRate::Interlaced &&
+            (x & 1) != state.halfrate.parity)
+          continue;
+
+        stats.columns++;
+
         int shade = (x == x0 || x == x1) ? 192 : 255 - wallshade;
 
         const f32 xp =
@@ -436,12 +790,13 @@ static void render() {
 
         // floor
         if (yf > state.y_lo[x]) {
-          verline(x, state.y_lo[x], yf, 0xFFFF0000); // red for floor
+          stats.pixels +=
+              verline(x, state.y_lo[x], yf, 0xFFFF0000); // red for floor
         }
 
         // celing
         if (yc < state.y_hi[x]) {
-          verline(x, yc, state.y_hi[x], 0xFF00FFFF); // magenta
+          stats.pixels += verline(x, yc, state.y_hi[x], 0xFF00FFFF); // magenta
         }
 
         if (wall->portal != SECTOR_NONE) {
@@ -453,20 +808,23 @@ static void render() {
                                      static_cast<int>(state.y_hi[x]));
 
           // draw upper part of portal wall
-          verline(x, nyc, yc, abgr_mul(0xFF00FF00, shade)); // green
+          stats.pixels +=
+              verline(x, nyc, yc, abgr_mul(0xFF00FF00, shade)); // green
           // draw lower part of portal wall
-          verline(x, yf, nyf, abgr_mul(0xFF0000FF, shade)); // blue
+          stats.pixels +=
+              verline(x, yf, nyf, abgr_mul(0xFF0000FF, shade)); // blue
 
           state.y_hi[x] = std::clamp(
               std::min(std::min(yc, nyc), static_cast<int>(state.y_hi[x])), 0,
-              SCREEN_HEIGHT - 1);
+              state.h - 1);
 
           state.y_lo[x] = std::clamp(
               std::max(std::max(yf, nyf), static_cast<int>(state.y_lo[x])), 0,
-              SCREEN_HEIGHT - 1);
+              state.h - 1);
         } else {
           // solid wall
-          verline(x, yf, yc, abgr_mul(0xFFD0D0D0, shade)); // grey
+          stats.pixels +=
+              verline(x, yf, yc, abgr_mul(0xFFD0D0D0, shade)); // grey
         }
 
         if (state.sleepy) {
@@ -475,18 +833,338 @@ static void render() {
         }
       }
 
-      if (wall->portal != SECTOR_NONE) {
+      // a closed door or fully raised lift hides everything behind it
+      if (wall->portal != SECTOR_NONE && wc->open) {
         ASSERT(queue.n != QUEUE_MAX, "out of queue space");
         queue.arr[queue.n++] = {wall->portal, x0, x1};
       }
     }
   }
+
+  return stats;
+}
+
+// strip workers, started once and woken for every batch of strips. the
+// calling thread renders the first strip itself
+static struct {
+  std::thread threads[MAX_THREADS];
+  int started;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  u64 batch;   // bumped for every batch of strips
+  int n;       // strips in the current batch
+  int pending; // strips of the current batch not finished yet
+  bool quit;
+  int x0[MAX_THREADS], x1[MAX_THREADS];
+  RenderStats stats[MAX_THREADS];
+} workers;
+
+static void strip_worker(const int t) {
+  u64 seen = 0;
+  for (;;) {
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    workers.wake.wait(lock,
+                      [&seen] { return workers.quit || workers.batch != seen; });
+    if (workers.quit)
+      return;
+
+    seen = workers.batch;
+    if (t >= workers.n)
+      continue;
+    lock.unlock();
+
+    workers.stats[t] = render_columns(workers.x0[t], workers.x1[t]);
+
+    lock.lock();
+    if (--workers.pending == 0)
+      workers.done.notify_one();
+  }
+}
+
+static void stop_workers() {
+  {
+    std::lock_guard<std::mutex> lock(workers.mutex);
+    workers.quit = true;
+  }
+  workers.wake.notify_all();
+  for (int t = 1; t < workers.started; t++)
+    workers.threads[t].join();
+  workers.started = 0;
+  workers.quit = false;
+}
+
+// render columns [cx0..cx1] split into one strip per thread
+static RenderStats render_strips(const int cx0, const int cx1) {
+  // sleepy mode presents from inside the renderer
+  const int n =
+      state.sleepy ? 1 : std::clamp(state.tuning.threads, 1, MAX_THREADS);
+  const int width = cx1 - cx0 + 1;
+
+  if (n == 1 || width < n)
+    return render_columns(cx0, cx1);
+
+  {
+    std::lock_guard<std::mutex> lock(workers.mutex);
+    // worker 0 is the calling thread
+    for (workers.started = std::max(workers.started, 1);
+         workers.started < n; workers.started++) {
+      workers.threads[workers.started] =
+          std::thread(strip_worker, workers.started);
+    }
+
+    for (int t = 0; t < n; t++) {
+      workers.x0[t] = cx0 + width * t / n;
+      workers.x1[t] = cx0 + width * (t + 1) / n - 1;
+    }
+    workers.n = n;
+    workers.pending = n - 1;
+    workers.batch++;
+  }
+  workers.wake.notify_all();
+
+  workers.stats[0] = render_columns(workers.x0[0], workers.x1[0]);
+
+  {
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    workers.done.wait(lock, [] { return workers.pending == 0; });
+  }
+
+  // every strip walks the same sectors
+  RenderStats stats = {};
+  for (int t = 0; t < n; t++) {
+    stats.sectors = std::max(stats.sectors, workers.stats[t].sectors);
+    stats.walls += workers.stats[t].walls;
+    stats.columns += workers.stats[t].columns;
+    stats.pixels += workers.stats[t].pixels;
+  }
+  return stats;
+}
+
+// reuse the columns of the last frame when the camera only turned in place.
+// a column keeps its world angle, so it is looked up by angle and rescaled
+// vertically around the horizon since its depth changes with cos(angle).
+// only the newly exposed columns plus a guard band are rendered again.
+// returns false if a full render is needed.
+static bool render_reprojected() {
+  auto &h = state.history;
+
+  if (!h.valid || h.disabled || state.sleepy ||
+      h.version != state.derived.version || h.sector != state.camera.sector ||
+      h.pos.x != state.camera.pos.x || h.pos.y != state.camera.pos.y) {
+    return false;
+  }
+
+  // world angle = camera angle + screen angle
+  const f32 turn = normalize_angle(state.camera.angle - h.angle);
+  if (std::fabs(turn) > HFOV / 2)
+    return false;
+
+  static int src_x[SCREEN_WIDTH];
+  static f32 src_scale[SCREEN_WIDTH];
+
+  int miss0 = state.w, miss1 = -1;
+  for (int x = 0; x < state.w; x++) {
+    const f32 a = screen_x_to_angle(x), a_old = a + turn;
+
+    src_x[x] = -1;
+    if (a_old > -(HFOV / 2) && a_old < +(HFOV / 2)) {
+      const int xo = screen_angle_to_x(a_old);
+      if (xo >= 0 && xo < state.w) {
+        src_x[x] = xo;
+        src_scale[x] = std::cos(a) / std::cos(a_old);
+      }
+    }
+
+    if (src_x[x] < 0) {
+      miss0 = std::min(miss0, x);
+      miss1 = std::max(miss1, x);
+    }
+  }
+
+  if (miss1 - miss0 + 1 + 2 * REPROJECT_GUARD > REPROJECT_MAX_MISSING * state.w)
+    return false;
+
+  int rx0 = state.w, rx1 = -1;
+  state.stats = {};
+  if (miss1 >= 0) {
+    rx0 = std::max(miss0 - REPROJECT_GUARD, 0);
+    rx1 = std::min(miss1 + REPROJECT_GUARD, state.w - 1);
+    state.stats = render_strips(rx0, rx1);
+  }
+
+  // y_old = cy + (y - cy) * scale, stepped in 16.16 fixed point. walk the
+  // frame row by row so reads and writes stay mostly sequential
+  const int cy = state.h / 2;
+  static i32 yo[SCREEN_WIDTH], step[SCREEN_WIDTH];
+  for (int x = 0; x < state.w; x++) {
+    step[x] = static_cast<i32>(src_scale[x] * 65536.0f);
+    yo[x] = cy * 65536 - cy * step[x];
+  }
+
+  const auto copy_rows = [&](const int x0, const int x1) {
+    for (int y = 0; y < state.h; y++) {
+      u32 *dst = &state.pixels[y * state.w];
+      for (int x = x0; x < x1; x++) {
+        const int sy = std::clamp(yo[x] >> 16, 0, state.h - 1);
+        dst[x] = h.pixels[sy * state.w + src_x[x]];
+        yo[x] += step[x];
+      }
+    }
+  };
+
+  if (miss1 >= 0) {
+    copy_rows(0, rx0);
+    copy_rows(rx1 + 1, state.w);
+    h.reused = state.w - (rx1 - rx0 + 1);
+  } else {
+    copy_rows(0, state.w);
+    h.reused = state.w;
+  }
+
+  h.chain++;
+  return true;
+}
+
+// per channel average of two colors
+static u32 blend(const u32 a, const u32 b) {
+  return (((a ^ b) & 0xFEFEFEFE) >> 1) + (a & b);
+}
+
+// fill the pixels skipped by half-rate rendering, from the last frame when the
+// camera (nearly) stood still and by blending the left and right neighbor,
+// which were drawn this frame, otherwise
+static void reconstruct_halfrate() {
+  const auto &h = state.history;
+  const bool temporal =
+      h.valid && h.version == state.derived.version &&
+      std::fabs(state.camera.pos.x - h.pos.x) < HALFRATE_FAST_MOVE &&
+      std::fabs(state.camera.pos.y - h.pos.y) < HALFRATE_FAST_MOVE &&
+      std::fabs(normalize_angle(state.camera.angle - h.angle)) <
+          HALFRATE_FAST_TURN;
+
+  const bool checker = state.halfrate.mode == HalfRate::Checkerboard;
+  for (int y = 0; y < state.h; y++) {
+    u32 *row = &state.pixels[y * state.w];
+    const u32 *prev = &h.pixels[y * state.w];
+
+    // first skipped x in this row
+    const int x0 = ((checker ? y : 0) + state.halfrate.parity + 1) & 1;
+    for (int x = x0; x < state.w; x += 2) {
+      if (temporal) {
+        row[x] = prev[x];
+      } else if (x == 0) {
+        row[x] = row[x + 1];
+      } else if (x == state.w - 1) {
+        row[x] = row[x - 1];
+      } else {
+        row[x] = blend(row[x - 1], row[x + 1]);
+      }
+    }
+  }
+}
+
+static void render() {
+  if (state.halfrate.mode != HalfRate::Off) {
+    state.stats = render_strips(0, state.w - 1);
+    reconstruct_halfrate();
+    state.halfrate.parity ^= 1;
+    state.history.chain = 0;
+    state.history.reused = 0;
+  } else if (!render_reprojected()) {
+    state.stats = render_strips(0, state.w - 1);
+    state.history.chain = 0;
+    state.history.reused = 0;
+  }
+
   state.sleepy = false;
 }
 
+// keep fully rendered frames around as key frame for reprojection
+static void end_frame() {
+  auto &h = state.history;
+  if (h.chain != 0)
+    return;
+
+  std::swap(state.pixels, h.pixels);
+
+  // the dev overlay is drawn on top of the frame and must not be reused
+  h.valid = !state.dev.mode;
+  h.pos = state.camera.pos;
+  h.angle = state.camera.angle;
+  h.sector = state.camera.sector;
+  h.version = state.derived.version;
+}
+
+// find the sector the camera is in, starting at its last known sector
+static void update_camera_sector() {
+  constexpr int PLAYER_SECTOR_QUEUE_MAX = 64;
+  int queue[PLAYER_SECTOR_QUEUE_MAX] = {state.camera.sector},
+      head = 0,  // head for circular queue
+      tail = 0,  // tail for circular queue
+      count = 0; // number of elements in queue
+
+  // Add initial sector
+  queue[tail] = state.camera.sector;
+  tail = (tail + 1) % PLAYER_SECTOR_QUEUE_MAX;
+  count = 1;
+
+  int found_sector = SECTOR_NONE;
+  bool visited[SECTOR_MAX] = {false};
+
+  while (count > 0) {
+    const int id = queue[head];
+    head = (head + 1) % PLAYER_SECTOR_QUEUE_MAX;
+    count--;
+
+    if (id < 1 || id >= static_cast<int>(state.sectors.n) || visited[id]) {
+      continue;
+    }
+    visited[id] = true;
+
+    const Sector *sector = &state.sectors.arr[id];
+    if (point_in_sector(sector, state.camera.pos)) {
+      found_sector = id;
+      break;
+    }
+
+    for (usize j = 0; j < sector->nwalls; j++) {
+      const Wall *wall = &state.walls.arr[sector->firstwall + j];
+      if (wall->portal != SECTOR_NONE) {
+        if (count == PLAYER_SECTOR_QUEUE_MAX) {
+          fprintf(stderr, "Player sector update: out of queue space!\n");
+          goto player_sector_done;
+        }
+        if (wall->portal > 0 && wall->portal < SECTOR_MAX &&
+            !visited[wall->portal]) {
+          queue[tail] = wall->portal;
+          tail = (tail + 1) % PLAYER_SECTOR_QUEUE_MAX;
+          count++;
+        }
+      }
+    }
+  }
+player_sector_done:
+  if (found_sector == SECTOR_NONE) {
+    // fallback: if player is not in any reachable sector (e.g. noclip out
+    // of map) Try checking all sectors (less efficient but robust)
+    bool truly_lost = true;
+    for (usize k = 1; k < state.sectors.n; ++k) {
+      if (point_in_sector(&state.sectors.arr[k], state.camera.pos)) {
+        state.camera.sector = state.sectors.arr[k].id;
+        truly_lost = false;
+        break;
+      }
+    }
+    if (truly_lost)
+      state.camera.sector = 1; // default to sector 1 if completely lost
+  } else {
+    state.camera.sector = found_sector;
+  }
+}
+
 static void draw_pixel(int x, int y, u32 color) {
-  if (x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT) {
-    state.pixels[y * SCREEN_WIDTH + x] = color;
+  if (x >= 0 && x < state.w && y >= 0 && y < state.h) {
+    state.pixels[y * state.w + x] = color;
   }
 }
 
@@ -544,11 +1222,12 @@ static void draw_circle(int x0, int y0, int radius, u32 color) {
 }
 
 static void render_dev_version() {
-  constexpr int scale = downscaled ? 30.0f : 100.0f;
-  constexpr int offsetX =
-      downscaled ? SCREEN_WIDTH / 2 + 140 : SCREEN_WIDTH / 2 + 400;
-  constexpr int offsetY =
-      downscaled ? SCREEN_HEIGHT / 2 + 120 : SCREEN_HEIGHT / 2 + 380;
+  // the map is laid out for the full resolution, shrink it with the render
+  // scale
+  const f32 fit = static_cast<f32>(state.w) / SCREEN_WIDTH;
+  const int scale = (downscaled ? 30.0f : 100.0f) * fit;
+  const int offsetX = state.w / 2 + (downscaled ? 140 : 400) * fit;
+  const int offsetY = state.h / 2 + (downscaled ? 120 : 380) * fit;
 
   // draw all walls
   for (usize i = 0; i < state.walls.n; i++) {
@@ -583,9 +1262,9 @@ static void present() {
   int pitch;
   SDL_LockTexture(state.texture, nullptr, &px, &pitch);
   {
-    for (usize y = 0; y < SCREEN_HEIGHT; y++) {
-      memcpy(&static_cast<u8 *>(px)[y * pitch], &state.pixels[y * SCREEN_WIDTH],
-             SCREEN_WIDTH * 4);
+    for (int y = 0; y < state.h; y++) {
+      memcpy(&static_cast<u8 *>(px)[y * pitch], &state.pixels[y * state.w],
+             state.w * 4);
     }
   }
   SDL_UnlockTexture(state.texture);
@@ -598,10 +1277,261 @@ static void present() {
   SDL_RenderCopyEx(state.renderer, state.texture, nullptr, nullptr, 0.0,
                    nullptr, SDL_FLIP_VERTICAL);
 
+  // HUD goes on top of the stretched frame
+  if (state.hud.pending) {
+    ImGui::Render();
+    ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData(),
+                                          state.renderer);
+    state.hud.pending = false;
+  }
+
   SDL_RenderPresent(state.renderer);
 }
 
+// (re)create the streaming texture for the current render scale
+static void resize_render_target() {
+  const f32 scale = state.tuning.render_scale;
+  state.w = std::max(static_cast<int>(SCREEN_WIDTH * scale), 64);
+  state.h = std::max(static_cast<int>(SCREEN_HEIGHT * scale), 36);
+
+  if (state.texture)
+    SDL_DestroyTexture(state.texture);
+  state.texture =
+      SDL_CreateTexture(state.renderer, SDL_PIXELFORMAT_ABGR8888,
+                        SDL_TEXTUREACCESS_STREAMING, state.w, state.h);
+  ASSERT(state.texture, "failed to create SDL texture: %s\n", SDL_GetError());
+
+  state.history.valid = false;
+}
+
+// apply settings changed in the HUD, all of them take effect next frame
+static void apply_tuning(const Tuning &prev) {
+  if (state.tuning.render_scale != prev.render_scale)
+    resize_render_target();
+  if (state.tuning.projection != prev.projection)
+    state.history.valid = false;
+  if (state.tuning.present != prev.present)
+    SDL_RenderSetVSync(state.renderer,
+                       state.tuning.present == PresentMode::Vsync);
+}
+
+static void profile_begin_frame() {
+  if (!state.hud.open)
+    return;
+
+  state.profile.frame_start = state.profile.zone_start =
+      SDL_GetPerformanceCounter();
+}
+
+// close the zone which started at the end of the previous one
+static void profile_zone(const Zone zone) {
+  if (!state.hud.open)
+    return;
+
+  const u64 now = SDL_GetPerformanceCounter();
+  state.profile.zone_ms[zone][state.profile.head] =
+      1000.0f * (now - state.profile.zone_start) / SDL_GetPerformanceFrequency();
+  state.profile.zone_start = now;
+}
+
+static void profile_end_frame() {
+  if (!state.hud.open)
+    return;
+
+  const u64 now = SDL_GetPerformanceCounter();
+  state.profile.frame_ms[state.profile.head] =
+      1000.0f * (now - state.profile.frame_start) / SDL_GetPerformanceFrequency();
+  state.profile.head = (state.profile.head + 1) % PROFILE_FRAMES;
+}
+
+static void toggle_hud() {
+  state.hud.open = !state.hud.open;
+  if (!state.hud.open || state.hud.initialized)
+    return;
+
+  IMGUI_CHECKVERSION();
+  ImGui::CreateContext();
+  ImGui::GetIO().IniFilename = nullptr;
+  ImGui::StyleColorsDark();
+  ImGui_ImplSDL2_InitForSDLRenderer(state.window, state.renderer);
+  ImGui_ImplSDLRenderer2_Init(state.renderer);
+  state.hud.initialized = true;
+}
+
+// build the HUD for this frame, drawn later by present()
+static void build_hud() {
+  if (!state.hud.open)
+    return;
+
+  ImGui_ImplSDLRenderer2_NewFrame();
+  ImGui_ImplSDL2_NewFrame();
+  ImGui::NewFrame();
+
+  ImGui::SetNextWindowPos(ImVec2(8, 8), ImGuiCond_FirstUseEver);
+  ImGui::Begin("perf (F5)", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+
+  // last written entry is the previous frame
+  const int last = (state.profile.head + PROFILE_FRAMES - 1) % PROFILE_FRAMES;
+  char overlay[32];
+  snprintf(overlay, sizeof(overlay), "%.2f ms", state.profile.frame_ms[last]);
+  ImGui::PlotLines("frame", state.profile.frame_ms, PROFILE_FRAMES,
+                   state.profile.head, overlay, 0.0f, 33.3f, ImVec2(240, 60));
+  for (int z = 0; z < ZONE_COUNT; z++) {
+    snprintf(overlay, sizeof(overlay), "%.2f ms", state.profile.zone_ms[z][last]);
+    ImGui::PlotLines(ZONE_NAMES[z], state.profile.zone_ms[z], PROFILE_FRAMES,
+                     state.profile.head, overlay, 0.0f, 16.6f, ImVec2(240, 30));
+  }
+
+  ImGui::Separator();
+  ImGui::Text("resolution   %d x %d", state.w, state.h);
+  ImGui::Text("sectors      %d", state.stats.sectors);
+  ImGui::Text("walls        %d", state.stats.walls);
+  ImGui::Text("columns      %d (%d reprojected)", state.stats.columns,
+              state.history.reused);
+  ImGui::Text("pixels       %lld", static_cast<long long>(state.stats.pixels));
+
+  ImGui::Separator();
+  const Tuning prev = state.tuning;
+  ImGui::SliderFloat("render scale", &state.tuning.render_scale, 0.25f, 1.0f,
+                     "%.2f");
+  ImGui::SliderInt("threads", &state.tuning.threads, 1,
+                   std::min(SDL_GetCPUCount(), MAX_THREADS));
+
+  int projection = static_cast<int>(state.tuning.projection);
+  ImGui::Combo("projection", &projection, "perspective\0equiangular\0");
+  state.tuning.projection = static_cast<Projection>(projection);
+
+  int present = static_cast<int>(state.tuning.present);
+  ImGui::Combo("present", &present, "vsync\0immediate\0");
+  state.tuning.present = static_cast<PresentMode>(present);
+
+  int halfrate = static_cast<int>(state.halfrate.mode);
+  ImGui::Combo("half rate", &halfrate, "off\0interlaced\0checkerboard\0");
+  state.halfrate.mode = static_cast<HalfRate>(halfrate);
+
+  ImGui::End();
+  apply_tuning(prev);
+
+  state.hud.pending = true;
+}
+
+// camera path used by the benchmark: turn in place, walk a loop through
+// sector 1, then stand still
+static void bench_camera(const int frame) {
+  if (frame < 240) {
+    state.camera.pos = {3.0f, 2.5f};
+    state.camera.angle = frame * 0.03f;
+  } else if (frame < 480) {
+    const f32 t = (frame - 240) * (TAU / 240);
+    state.camera.pos = {3.0f + 1.2f * std::cos(t), 2.5f + 1.0f * std::sin(t)};
+    state.camera.angle = t + PI_2;
+  } else {
+    state.camera.pos = {3.0f, 2.5f};
+    state.camera.angle = 1.0f;
+  }
+
+  state.camera.anglecos = std::cos(state.camera.angle);
+  state.camera.anglesin = std::sin(state.camera.angle);
+  update_camera_sector();
+}
+
+// render the benchmark path in each mode without opening a window, report
+// the cost per frame and the quality against a full render of the same frame
+static int run_benchmark(const int threads) {
+  constexpr int FRAMES = 540;
+  constexpr usize NPIXELS = SCREEN_WIDTH * SCREEN_HEIGHT;
+
+  state.w = SCREEN_WIDTH;
+  state.h = SCREEN_HEIGHT;
+  state.tuning = {1.0f, std::clamp(threads, 1, MAX_THREADS),
+                  Projection::Perspective, PresentMode::Vsync};
+
+  state.pixels = new u32[NPIXELS];
+  state.history.pixels = new u32[NPIXELS];
+  u32 *frame = new u32[NPIXELS];
+
+  const int retval = load_sectors(LEVEL_FILE);
+  ASSERT(retval == 0, "error while loading sectors: %d\n", retval);
+  build_derived();
+
+  struct {
+    const char *name;
+    HalfRate mode;
+    bool reproject;
+  } modes[] = {
+      {"full", HalfRate::Off, false},
+      {"reproject", HalfRate::Off, true},
+      {"interlaced", HalfRate::Interlaced, false},
+      {"checkerboard", HalfRate::Checkerboard, false},
+  };
+
+  const f64 freq = static_cast<f64>(SDL_GetPerformanceFrequency());
+  printf("%-14s %10s %10s %10s %10s\n", "mode", "ms/frame", "psnr avg",
+         "psnr min", "diff %");
+
+  for (const auto &m : modes) {
+    state.history.valid = false;
+    state.history.disabled = !m.reproject;
+    state.halfrate.parity = 0;
+    state.camera.sector = 1;
+
+    f64 total = 0, psnr_sum = 0, psnr_min = 1e9, diff_sum = 0;
+    for (int i = 0; i < FRAMES; i++) {
+      bench_camera(i);
+
+      state.halfrate.mode = m.mode;
+
+      memset(state.pixels, 0, NPIXELS * sizeof(u32));
+      const u64 t0 = SDL_GetPerformanceCounter();
+      render();
+      total += (SDL_GetPerformanceCounter() - t0) / freq;
+
+      // full render of the same frame as reference, then put the measured
+      // frame back so it becomes the history
+      memcpy(frame, state.pixels, NPIXELS * sizeof(u32));
+      state.halfrate.mode = HalfRate::Off;
+      memset(state.pixels, 0, NPIXELS * sizeof(u32));
+      render_columns(0, state.w - 1);
+
+      f64 sq = 0;
+      usize ndiff = 0;
+      for (usize p = 0; p < NPIXELS; p++) {
+        const u32 a = frame[p], b = state.pixels[p];
+        ndiff += a != b;
+        for (int c = 0; c < 24; c += 8) {
+          const f64 d = static_cast<f64>((a >> c) & 0xFF) - ((b >> c) & 0xFF);
+          sq += d * d;
+        }
+      }
+
+      const f64 mse = sq / (NPIXELS * 3);
+      const f64 psnr = mse == 0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+      psnr_sum += psnr;
+      psnr_min = std::min(psnr_min, psnr);
+      diff_sum += 100.0 * ndiff / NPIXELS;
+
+      memcpy(state.pixels, frame, NPIXELS * sizeof(u32));
+      end_frame();
+    }
+
+    printf("%-14s %10.3f %10.2f %10.2f %10.2f\n", m.name,
+           1000.0 * total / FRAMES, psnr_sum / FRAMES, psnr_min,
+           diff_sum / FRAMES);
+  }
+
+  stop_workers();
+  state.history.disabled = false;
+  delete[] frame;
+  delete[] state.history.pixels;
+  delete[] state.pixels;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  // --bench [threads]
+  if (argc > 1 && !strcmp(argv[1], "--bench"))
+    return run_benchmark(argc > 2 ? atoi(argv[2]) : 1);
+
   ASSERT(!SDL_Init(SDL_INIT_VIDEO), "SDL failed to initialize: %s",
          SDL_GetError());
 
@@ -614,13 +1544,13 @@ int main(int argc, char *argv[]) {
       state.window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
   ASSERT(state.renderer, "failed to create SDL renderer: %s\n", SDL_GetError());
 
-  state.texture = SDL_CreateTexture(state.renderer, SDL_PIXELFORMAT_ABGR8888,
-                                    SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH,
-                                    SCREEN_HEIGHT);
-  ASSERT(state.texture, "failed to create SDL texture: %s\n", SDL_GetError());
+  state.tuning = {1.0f, 1, Projection::Perspective, PresentMode::Vsync};
+  resize_render_target();
 
   state.pixels = new u32[SCREEN_WIDTH * SCREEN_HEIGHT];
   ASSERT(state.pixels, "failed to allocate pixel buffer\n");
+  state.history.pixels = new u32[SCREEN_WIDTH * SCREEN_HEIGHT];
+  state.history.valid = false;
 
   state.camera.pos = {3.0f, 3.0f};
   state.camera.angle = 0.0f;
@@ -633,18 +1563,36 @@ int main(int argc, char *argv[]) {
   int retval = 0;
   retval = load_sectors(LEVEL_FILE);
   ASSERT(retval == 0, "error while loading sectors: %d\n", retval);
-  printf("loaded %zu sectors with %zu walls\n",
+  printf("loaded %zu sectors with %zu walls and %zu movers\n",
          state.sectors.n - 1, // state.sectors.n includes the dummy sector 0
-         state.walls.n);
+         state.walls.n, state.movers.n);
+  build_derived();
 
   while (!state.quit) {
 	int mouseX, mouseY;
+    profile_begin_frame();
+
     SDL_Event ev;
     while (SDL_PollEvent(&ev)) {
+      if (state.hud.open)
+        ImGui_ImplSDL2_ProcessEvent(&ev);
+
       switch (ev.type) {
       case SDL_QUIT:
         state.quit = true;
         break;
+      case SDL_KEYDOWN:
+        if (ev.key.repeat)
+          break;
+        if (ev.key.keysym.scancode == SDL_SCANCODE_E)
+          use_movers();
+        if (ev.key.keysym.scancode == SDL_SCANCODE_F4) {
+          state.halfrate.mode = static_cast<HalfRate>(
+              (static_cast<int>(state.halfrate.mode) + 1) % 3);
+        }
+        if (ev.key.keysym.scancode == SDL_SCANCODE_F5)
+          toggle_hud();
+        break;
       default:
         break;
       }
@@ -657,6 +1605,11 @@ int main(int argc, char *argv[]) {
 
     const u8 *keystate = SDL_GetKeyboardState(nullptr);
 
+    // keys typed into the HUD do not move the camera
+    static const u8 no_keys[SDL_NUM_SCANCODES] = {};
+    if (state.hud.open && ImGui::GetIO().WantCaptureKeyboard)
+      keystate = no_keys;
+
     if (keystate[SDL_SCANCODE_RIGHT])
       state.camera.angle -= rot_speed;
     if (keystate[SDL_SCANCODE_D]) {
@@ -689,74 +1642,17 @@ int main(int argc, char *argv[]) {
     if (keystate[SDL_SCANCODE_F3])
       state.dev.mode = false;
 
-    // update player sector
-    {
-      constexpr int PLAYER_SECTOR_QUEUE_MAX = 64;
-      int queue[PLAYER_SECTOR_QUEUE_MAX] = {state.camera.sector},
-          head = 0,  // head for circular queue
-          tail = 0,  // tail for circular queue
-          count = 0; // number of elements in queue
-
-      // Add initial sector
-      queue[tail] = state.camera.sector;
-      tail = (tail + 1) % PLAYER_SECTOR_QUEUE_MAX;
-      count = 1;
+    profile_zone(ZONE_INPUT);
 
-      int found_sector = SECTOR_NONE;
-      bool visited[SECTOR_MAX] = {false};
+    update_camera_sector();
 
-      while (count > 0) {
-        const int id = queue[head];
-        head = (head + 1) % PLAYER_SECTOR_QUEUE_MAX;
-        count--;
+    update_movers(0.016f);
+    profile_zone(ZONE_UPDATE);
 
-        if (id < 1 || id >= static_cast<int>(state.sectors.n) || visited[id]) {
-          continue;
-        }
-        visited[id] = true;
+    build_hud();
+    profile_zone(ZONE_HUD);
 
-        const Sector *sector = &state.sectors.arr[id];
-        if (point_in_sector(sector, state.camera.pos)) {
-          found_sector = id;
-          break;
-        }
-
-        for (usize j = 0; j < sector->nwalls; j++) {
-          const Wall *wall = &state.walls.arr[sector->firstwall + j];
-          if (wall->portal != SECTOR_NONE) {
-            if (count == PLAYER_SECTOR_QUEUE_MAX) {
-              fprintf(stderr, "Player sector update: out of queue space!\n");
-              goto player_sector_done;
-            }
-            if (wall->portal > 0 && wall->portal < SECTOR_MAX &&
-                !visited[wall->portal]) {
-              queue[tail] = wall->portal;
-              tail = (tail + 1) % PLAYER_SECTOR_QUEUE_MAX;
-              count++;
-            }
-          }
-        }
-      }
-    player_sector_done:
-      if (found_sector == SECTOR_NONE) {
-        // fallback: if player is not in any reachable sector (e.g. noclip out
-        // of map) Try checking all sectors (less efficient but robust)
-        bool truly_lost = true;
-        for (usize k = 1; k < state.sectors.n; ++k) {
-          if (point_in_sector(&state.sectors.arr[k], state.camera.pos)) {
-            state.camera.sector = state.sectors.arr[k].id;
-            truly_lost = false;
-            break;
-          }
-        }
-        if (truly_lost)
-          state.camera.sector = 1; // default to sector 1 if completely lost
-      } else {
-        state.camera.sector = found_sector;
-      }
-    }
-
-    memset(state.pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32));
+    memset(state.pixels, 0, state.w * state.h * sizeof(u32));
 
     if (state.dev.mode) {
       render();
@@ -764,11 +1660,24 @@ int main(int argc, char *argv[]) {
     } else {
       render();
     }
+    profile_zone(ZONE_RENDER);
 
     if (!state.sleepy)
       present();
+    profile_zone(ZONE_PRESENT);
+
+    end_frame();
+    profile_end_frame();
+  }
+
+  if (state.hud.initialized) {
+    ImGui_ImplSDLRenderer2_Shutdown();
+    ImGui_ImplSDL2_Shutdown();
+    ImGui::DestroyContext();
   }
 
+  stop_workers();
+  delete[] state.history.pixels;
   delete[] state.pixels;
   SDL_DestroyTexture(state.texture);
   SDL_DestroyRenderer(state.renderer);
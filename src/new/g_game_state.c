@@ -1,8 +1,9 @@
 #include "g_game_state.h"
 
-int frame_start = 0;
+Uint64 frame_start = 0;
+Uint64 frame_deadline = 0;
 
-game_state_t G_Init(const unsigned int scrnw, const unsigned int scrnh, int target_fps)
+game_state_t G_Init(const unsigned int scrnw, const unsigned int scrnh, int target_fps, double spin_window)
 {
     game_state_t game_state;
     game_state.is_debug_mode = false;
@@ -11,25 +12,128 @@ game_state_t G_Init(const unsigned int scrnw, const unsigned int scrnh, int targ
     game_state.scrn_w = scrnw;
     game_state.target_fps = target_fps;
     game_state.target_frame_time = 1.0 / (double) game_state.target_fps;
+    game_state.spin_window = spin_window;
     game_state.is_fps_capped = false;
     game_state.delta_time = game_state.target_frame_time;
     game_state.is_debug_mode = false;
+    game_state.is_front_to_back = false;
+    game_state.is_overdraw_view = false;
+
+    memset(&game_state.frame_stats, 0, sizeof(frame_stats_t));
+    game_state.frame_stats.min = 1e9;
 
     return game_state;
 }
 
+double G_Seconds(Uint64 ticks)
+{
+    return (double)ticks / (double)SDL_GetPerformanceFrequency();
+}
+
 void G_FrameStart()
 {
-    frame_start = SDL_GetTicks();
+    // the previous frame ends where this one starts, including the wait
+    if (frame_start == 0)
+        frame_start = SDL_GetPerformanceCounter();
+}
+
+void G_RecordFrame(frame_stats_t *stats, double frame_time)
+{
+    int bin = frame_time * 1000.0 / G_HIST_BIN_MS;
+    if (bin > G_HIST_BINS)
+        bin = G_HIST_BINS;
+
+    stats->hist[bin]++;
+    stats->frames++;
+    stats->sum += frame_time;
+    stats->sum_sq += frame_time * frame_time;
+
+    if (frame_time < stats->min) stats->min = frame_time;
+    if (frame_time > stats->max) stats->max = frame_time;
+}
+
+// wait for the frame's deadline: sleep while more than the spin window is
+// left, then spin on the performance counter for the rest
+void G_WaitUntil(Uint64 deadline, double spin_window)
+{
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 spin = spin_window * freq;
+
+    for (;;)
+    {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline)
+            return;
+
+        Uint64 left = deadline - now;
+        if (left <= spin)
+            break;
+
+        Uint32 ms = (left - spin) * 1000 / freq;
+        SDL_Delay(ms > 0 ? ms : 1);
+    }
+
+    while (SDL_GetPerformanceCounter() < deadline)
+        ;
 }
 
 void G_FrameEnd(game_state_t *state)
 {
-    state->delta_time = (SDL_GetTicks() - frame_start) / 1000.0;
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 target = state->target_frame_time * freq;
+
+    // deadlines advance by exactly one frame so rounding does not drift,
+    // after a long frame pacing restarts from now instead of catching up
+    Uint64 now = SDL_GetPerformanceCounter();
+    frame_deadline = frame_deadline == 0 ? frame_start + target : frame_deadline + target;
+    if (now > frame_deadline + target)
+        frame_deadline = now;
+
+    G_WaitUntil(frame_deadline, state->spin_window);
+
+    Uint64 end = SDL_GetPerformanceCounter();
+    state->delta_time = G_Seconds(end - frame_start);
+    frame_start = end;
+
+    G_RecordFrame(&state->frame_stats, state->delta_time);
+}
+
+// print the frame time histogram and pacing jitter
+void G_DumpFrameStats(game_state_t *state)
+{
+    frame_stats_t *s = &state->frame_stats;
+    if (s->frames == 0)
+        return;
+
+    double mean = s->sum / s->frames;
+    double var = s->sum_sq / s->frames - mean * mean;
+    double stddev = var > 0 ? sqrt(var) : 0;
+
+    printf("frames %lu, target %.3f ms, mean %.3f ms, min %.3f ms, max %.3f ms\n",
+           s->frames, state->target_frame_time * 1000.0, mean * 1000.0,
+           s->min * 1000.0, s->max * 1000.0);
+    printf("jitter: stddev %.3f ms, mean offset from target %+.3f ms\n",
+           stddev * 1000.0, (mean - state->target_frame_time) * 1000.0);
+
+    // percentiles at bin resolution
+    double pcts[3] = {0.5, 0.99, 0.999};
+    unsigned long seen = 0;
+    int p = 0;
+    for (int i = 0; i <= G_HIST_BINS && p < 3; i++)
+    {
+        seen += s->hist[i];
+        while (p < 3 && seen >= pcts[p] * s->frames)
+            printf("p%-5g < %.2f ms\n", pcts[p++] * 100.0, (i + 1) * G_HIST_BIN_MS);
+    }
 
-    if (state->delta_time < state->target_frame_time)
+    for (int i = 0; i <= G_HIST_BINS; i++)
     {
-        SDL_Delay((state->target_frame_time - state->delta_time) * 1000.0);
-        state->delta_time = state->target_frame_time;
+        if (s->hist[i] == 0)
+            continue;
+
+        if (i == G_HIST_BINS)
+            printf("  >= %6.2f ms %8u\n", i * G_HIST_BIN_MS, s->hist[i]);
+        else
+            printf("  %6.2f ms %8u\n", i * G_HIST_BIN_MS, s->hist[i]);
     }
-}
\ No newline at end of file
+}
@@ -7,22 +7,40 @@
 
 #include "typedefs.h"
 
+#define G_HIST_BINS 200
+#define G_HIST_BIN_MS 0.25
+
+typedef struct _frame_stats
+{
+    unsigned int hist[G_HIST_BINS + 1]; // the last bin collects longer frames
+    unsigned long frames;
+    double sum;
+    double sum_sq;
+    double min;
+    double max;
+} frame_stats_t;
+
 typedef struct _game_state
 {
     unsigned int scrn_w;
     unsigned int scrn_h;
     double target_fps;
     double target_frame_time;
+    double spin_window; // seconds before the deadline spent spinning
     double delta_time;
     bool is_running;
     bool is_paused;
     bool is_fps_capped;
     bool state_show_map;
     bool is_debug_mode;
+    bool is_front_to_back;
+    bool is_overdraw_view;
+    frame_stats_t frame_stats;
 } game_state_t;
 
-game_state_t G_Init(const unsigned int scrnw, const unsigned int scrnh, int target_fps);
+game_state_t G_Init(const unsigned int scrnw, const unsigned int scrnh, int target_fps, double spin_window);
 void G_FrameStart();
 void G_FrameEnd(game_state_t *state);
+void G_DumpFrameStats(game_state_t *state);
 
 #endif /* G_GAME_STATE_H */
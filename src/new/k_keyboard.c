@@ -2,6 +2,10 @@
 
 keymap_t keymap;
 keystates_t keystates;
+key_hold_times_t held;
+input_ring_t input_ring;
+input_latency_t input_latency;
+Uint64 last_input_time = 0;
 const double MOV_SPEED = 150.0;
 const double ELEVATION_SPEED = 500 * 100;
 const double ROT_SPEED = 4;
@@ -19,6 +23,16 @@ void K_InitKeymap()
     keymap.down = SDL_SCANCODE_LCTRL;
     keymap.toggle_map = SDL_SCANCODE_M;
     keymap.debug_mode = SDL_SCANCODE_O;
+    keymap.front_to_back = SDL_SCANCODE_F;
+    keymap.overdraw_view = SDL_SCANCODE_H;
+    keymap.step_back = SDL_SCANCODE_LEFT;
+    keymap.step_forward = SDL_SCANCODE_RIGHT;
+    keymap.sector_back = SDL_SCANCODE_PAGEUP;
+    keymap.sector_forward = SDL_SCANCODE_PAGEDOWN;
+    keymap.replay = SDL_SCANCODE_P;
+    keymap.slower = SDL_SCANCODE_MINUS;
+    keymap.faster = SDL_SCANCODE_EQUALS;
+    keymap.capture = SDL_SCANCODE_C;
 
     keystates.forward = false;
     keystates.backward = false;
@@ -30,82 +44,148 @@ void K_InitKeymap()
     keystates.down = false;
     keystates.map_state = false;
     keystates.is_debug = false;
+
+    last_input_time = SDL_GetPerformanceCounter();
 }
 
-void K_HandleEvents(game_state_t *game_state, player_t *player)
+void K_PushEvent(SDL_Event *event, Uint64 time)
 {
+    input_event_t *e = &input_ring.events[input_ring.tail++ % K_RING_SIZE];
+    e->event = *event;
+    e->time = time;
+}
+
+// pull the pending SDL events into the ring. SDL stamps events in
+// milliseconds since init, which are moved onto the performance counter.
+// events that do not fit stay queued in SDL for the next frame, dropping
+// any could lose a key release and leave the key held down
+void K_DrainEvents(Uint64 now)
+{
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint32 now_ms = SDL_GetTicks();
+
     SDL_Event event;
-    SDL_PollEvent(&event);
+    while (input_ring.tail - input_ring.head < K_RING_SIZE && SDL_PollEvent(&event))
+    {
+        Uint32 age_ms = now_ms > event.common.timestamp ? now_ms - event.common.timestamp : 0;
+        Uint64 age = (Uint64)age_ms * freq / 1000;
+        K_PushEvent(&event, age < now ? now - age : now);
+    }
+
+    if (input_ring.tail - input_ring.head == K_RING_SIZE)
+        input_ring.full_frames++;
+}
+
+// add the time since the last input step to every held movement key
+void K_AccumulateHeld(Uint64 until)
+{
+    if (until <= last_input_time)
+        return;
+
+    double dt = (double)(until - last_input_time) / SDL_GetPerformanceFrequency();
+    last_input_time = until;
+
+    if (keystates.left) held.left += dt;
+    if (keystates.right) held.right += dt;
+    if (keystates.forward) held.forward += dt;
+    if (keystates.backward) held.backward += dt;
+    if (keystates.s_left) held.s_left += dt;
+    if (keystates.s_right) held.s_right += dt;
+    if (keystates.up) held.up += dt;
+    if (keystates.down) held.down += dt;
+}
 
-    switch (event.type)
+void K_HandleEvents(game_state_t *game_state, player_t *player)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    K_DrainEvents(now);
+
+    memset(&held, 0, sizeof(held));
+
+    // replay the frame's events in order so movement follows when keys
+    // actually went down and up instead of their state at frame start
+    while (input_ring.head != input_ring.tail)
     {
-    case SDL_KEYDOWN:
-        K_HandleRealtimeKeys(event.key.keysym.scancode, KEY_STATE_DOWN);
-        game_state->state_show_map = keystates.map_state;
+        input_event_t *e = &input_ring.events[input_ring.head++ % K_RING_SIZE];
+        SDL_Event *event = &e->event;
 
-        if (event.key.keysym.scancode == keymap.quit)
-            game_state->is_running = false;
+        K_AccumulateHeld(e->time);
+
+        switch (event->type)
+        {
+        case SDL_KEYDOWN:
+            K_HandleRealtimeKeys(event->key.keysym.scancode, KEY_STATE_DOWN);
+            game_state->state_show_map = keystates.map_state;
+
+            if (event->key.keysym.scancode == keymap.quit)
+                game_state->is_running = false;
+
+            if (event->key.keysym.scancode == keymap.debug_mode)
+                game_state->is_debug_mode = !game_state->is_debug_mode;
+
+            if (event->key.keysym.scancode == keymap.front_to_back)
+                game_state->is_front_to_back = !game_state->is_front_to_back;
+
+            if (event->key.keysym.scancode == keymap.overdraw_view)
+                game_state->is_overdraw_view = !game_state->is_overdraw_view;
+
+            if (game_state->is_debug_mode)
+                K_HandleInspectorKeys(event->key.keysym.scancode);
+
+            break;
 
-        if (event.key.keysym.scancode == keymap.debug_mode)
-            game_state->is_debug_mode = !game_state->is_debug_mode;
+        case SDL_KEYUP:
+            K_HandleRealtimeKeys(event->key.keysym.scancode, KEY_STATE_UP);
+            break;
 
-        break;
-    
-    case SDL_KEYUP:
-        K_HandleRealtimeKeys(event.key.keysym.scancode, KEY_STATE_UP);
-        break;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            if (game_state->is_debug_mode && event->button.button == SDL_BUTTON_LEFT)
+                R_InspectorMouse(event->button.x, event->button.y, event->type == SDL_MOUSEBUTTONDOWN, false);
+            break;
 
-    case SDL_QUIT:
-        game_state->is_running = false;
-        break;
-    default:
-        break;
+        case SDL_MOUSEMOTION:
+            if (game_state->is_debug_mode && (event->motion.state & SDL_BUTTON_LMASK))
+                R_InspectorMouse(event->motion.x, event->motion.y, true, true);
+            break;
+
+        case SDL_QUIT:
+            game_state->is_running = false;
+            break;
+        default:
+            break;
+        }
+
+        // latency probe, key repeats are generated by SDL and do not count
+        if ((event->type == SDL_KEYDOWN && !event->key.repeat) || event->type == SDL_KEYUP)
+        {
+            double latency = (double)(now - e->time) / SDL_GetPerformanceFrequency();
+            input_latency.events++;
+            input_latency.sum += latency;
+            if (latency > input_latency.max)
+                input_latency.max = latency;
+        }
     }
 
-    K_ProcessKeyStates(player, game_state->delta_time);
+    K_AccumulateHeld(now);
+    K_ProcessKeyStates(player, &held);
 }
 
-void K_ProcessKeyStates(player_t *player, double delta_time)
+// move by how long each key was held this frame, keys held the whole
+// frame move exactly as far as before
+void K_ProcessKeyStates(player_t *player, key_hold_times_t *held)
 {
-    if (keystates.forward)
-    {
-        player->position.x += MOV_SPEED * cos(player->dir_angle) * delta_time;
-        player->position.y += MOV_SPEED * sin(player->dir_angle) * delta_time;
-    }
-    else if (keystates.backward)
-    {
-        player->position.x -= MOV_SPEED * cos(player->dir_angle) * delta_time;
-        player->position.y -= MOV_SPEED * sin(player->dir_angle) * delta_time;
-    }
+    double move = MOV_SPEED * (held->forward - held->backward);
+    player->position.x += move * cos(player->dir_angle);
+    player->position.y += move * sin(player->dir_angle);
 
-    if (keystates.left)
-    {
-        player->dir_angle += ROT_SPEED * delta_time;
-    }
-    else if (keystates.right)
-    {
-        player->dir_angle -= ROT_SPEED * delta_time;
-    }
+    player->dir_angle += ROT_SPEED * (held->left - held->right);
 
-    if (keystates.s_left)
-    {
-        player->position.x += MOV_SPEED * cos(player->dir_angle + M_PI / 2) * delta_time;
-        player->position.y += MOV_SPEED * sin(player->dir_angle + M_PI / 2) * delta_time;
-    }
-    else if (keystates.s_right)
-    {
-        player->position.x -= MOV_SPEED * cos(player->dir_angle + M_PI / 2) * delta_time;
-        player->position.y -= MOV_SPEED * sin(player->dir_angle + M_PI / 2) * delta_time;
-    }
+    double strafe = MOV_SPEED * (held->s_left - held->s_right);
+    player->position.x += strafe * cos(player->dir_angle + M_PI / 2);
+    player->position.y += strafe * sin(player->dir_angle + M_PI / 2);
 
-    if (keystates.up)
-    {
-        player->z += ELEVATION_SPEED * delta_time;
-    } 
-    else if (keystates.down)
-    {
-        player->z -= ELEVATION_SPEED * delta_time;
-    }
+    player->z += ELEVATION_SPEED * (held->up - held->down);
 }
 
 
@@ -133,4 +213,35 @@ void K_HandleRealtimeKeys(SDL_Scancode key_scancode, enum KBD_KEY_STATE state)
 
     if (key_scancode == keymap.toggle_map && state == true)
         keystates.map_state = !keystates.map_state;
-}
\ No newline at end of file
+}
+
+// step through the recorded debug frame, key repeats keep stepping
+void K_HandleInspectorKeys(SDL_Scancode key_scancode)
+{
+    if (key_scancode == keymap.step_back)
+        R_InspectorStep(-1);
+    else if (key_scancode == keymap.step_forward)
+        R_InspectorStep(1);
+    else if (key_scancode == keymap.sector_back)
+        R_InspectorStepSector(-1);
+    else if (key_scancode == keymap.sector_forward)
+        R_InspectorStepSector(1);
+    else if (key_scancode == keymap.replay)
+        R_InspectorTogglePlay();
+    else if (key_scancode == keymap.slower)
+        R_InspectorSpeed(0.5);
+    else if (key_scancode == keymap.faster)
+        R_InspectorSpeed(2.0);
+    else if (key_scancode == keymap.capture)
+        R_RecorderDrop();
+}
+
+void K_DumpLatency()
+{
+    if (input_latency.events == 0)
+        return;
+
+    printf("input latency: %lu key events, mean %.3f ms, max %.3f ms, %lu frames with a full ring\n",
+           input_latency.events, input_latency.sum / input_latency.events * 1000.0,
+           input_latency.max * 1000.0, input_ring.full_frames);
+}
@@ -5,6 +5,7 @@
 
 #include "g_game_state.h"
 #include "p_player.h"
+#include "r_recorder.h"
 #include <stdio.h>
 
 typedef struct _keymap
@@ -20,6 +21,18 @@ typedef struct _keymap
     SDL_Scancode quit;
     SDL_Scancode toggle_map;
     SDL_Scancode debug_mode;
+    SDL_Scancode front_to_back;
+    SDL_Scancode overdraw_view;
+
+    // frame inspector, only while in debug mode
+    SDL_Scancode step_back;
+    SDL_Scancode step_forward;
+    SDL_Scancode sector_back;
+    SDL_Scancode sector_forward;
+    SDL_Scancode replay;
+    SDL_Scancode slower;
+    SDL_Scancode faster;
+    SDL_Scancode capture;
 } keymap_t;
 
 typedef struct _keystates
@@ -36,15 +49,55 @@ typedef struct _keystates
     bool is_debug;
 } keystates_t;
 
+// seconds each movement key was held during the current frame
+typedef struct _key_hold_times
+{
+    double left;
+    double right;
+    double forward;
+    double backward;
+    double s_left;
+    double s_right;
+    double up;
+    double down;
+} key_hold_times_t;
+
 enum KBD_KEY_STATE
 {
     KEY_STATE_UP,
     KEY_STATE_DOWN
 };
 
+#define K_RING_SIZE 256
+
+typedef struct _input_event
+{
+    SDL_Event event;
+    Uint64 time; // performance counter time the event happened
+} input_event_t;
+
+// events drained from SDL each frame, oldest first
+typedef struct _input_ring
+{
+    input_event_t events[K_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned long full_frames; // frames that left events in SDL's queue
+} input_ring_t;
+
+// delay from an event to the frame that handles it
+typedef struct _input_latency
+{
+    unsigned long events;
+    double sum;
+    double max;
+} input_latency_t;
+
 void K_InitKeymap();
 void K_HandleEvents(game_state_t *game_state, player_t *player);
-void K_ProcessKeyStates(player_t *player, double delta_time);
+void K_ProcessKeyStates(player_t *player, key_hold_times_t *held);
 void K_HandleRealtimeKeys(SDL_Scancode key_scancode, enum KBD_KEY_STATE state);
+void K_HandleInspectorKeys(SDL_Scancode key_scancode);
+void K_DumpLatency();
 
 #endif /* K_KEYBOARD_H */
@@ -0,0 +1,289 @@
+#include "l_level.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define L_POLL_INTERVAL 250 // ms between mtime checks without inotify
+#define L_HASH_SEED 2166136261u
+
+// parse target, reloads only commit it to the renderer if parsing worked
+sector_t parsed_sectors[L_MAX_SECTORS];
+unsigned int parsed_hashes[L_MAX_SECTORS];
+
+// FNV-1a over the numbers of a record, so comments and spacing do not count
+unsigned int L_HashInts(unsigned int hash, const int *v, int n)
+{
+    const unsigned char *p = (const unsigned char *)v;
+    for (size_t i = 0; i < n * sizeof(int); i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+bool L_Parse(const char *path, int *num_sectors)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        printf("Error opening level %s!\n", path);
+        return false;
+    }
+
+    char line[256];
+    int line_no = 0;
+    int n = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), f) != NULL)
+    {
+        line_no++;
+
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+
+        // sector <height> <elevation> <color> <ceil color> <floor color>
+        int v[7];
+        unsigned int clr[3];
+        if (sscanf(p, "sector %d %d %x %x %x", &v[0], &v[1], &clr[0], &clr[1], &clr[2]) == 5)
+        {
+            if (n == L_MAX_SECTORS)
+            {
+                printf("Error in level %s:%d: more than %d sectors!\n", path, line_no, L_MAX_SECTORS);
+                ok = false;
+                break;
+            }
+
+            parsed_sectors[n] = R_CreateSector(v[0], v[1], clr[0], clr[1], clr[2]);
+
+            int record[5] = {v[0], v[1], (int)clr[0], (int)clr[1], (int)clr[2]};
+            parsed_hashes[n] = L_HashInts(L_HASH_SEED, record, 5);
+            n++;
+            continue;
+        }
+
+        // wall <ax> <ay> <bx> <by>, portal adds <top height> <bottom height>
+        wall_t w;
+        int num_values;
+        if (sscanf(p, "portal %d %d %d %d %d %d", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 6)
+        {
+            w = R_CreatePortal(v[0], v[1], v[2], v[3], v[4], v[5]);
+            num_values = 6;
+        }
+        else if (sscanf(p, "wall %d %d %d %d", &v[0], &v[1], &v[2], &v[3]) == 4)
+        {
+            w = R_CreateWall(v[0], v[1], v[2], v[3]);
+            num_values = 4;
+        }
+        else
+        {
+            printf("Error in level %s:%d: cannot parse '%s'\n", path, line_no, strtok(p, "\r\n"));
+            ok = false;
+            break;
+        }
+
+        if (n == 0 || parsed_sectors[n - 1].num_walls == 10)
+        {
+            printf("Error in level %s:%d: wall outside of a sector or more than 10 walls!\n", path, line_no);
+            ok = false;
+            break;
+        }
+
+        R_SectorAddWall(&parsed_sectors[n - 1], w);
+
+        // portals and walls with the same points must not hash the same
+        v[num_values] = num_values;
+        parsed_hashes[n - 1] = L_HashInts(parsed_hashes[n - 1], v, num_values + 1);
+    }
+
+    fclose(f);
+
+    *num_sectors = n;
+    return ok;
+}
+
+void L_ReadFileStamp(level_t *level, time_t *mtime, long *size)
+{
+    struct stat st;
+    if (stat(level->path, &st) != 0)
+    {
+        *mtime = 0;
+        *size = -1;
+        return;
+    }
+
+    *mtime = st.st_mtime;
+    *size = (long)st.st_size;
+}
+
+void L_WatchInit(level_t *level)
+{
+    level->watch_fd = -1;
+    level->last_poll = SDL_GetTicks();
+    L_ReadFileStamp(level, &level->mtime, &level->size);
+
+#ifdef __linux__
+    // watch the directory, editors often save by renaming a new file over
+    // the old one which would end a watch on the file itself
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", level->path);
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    level->watch_fd = inotify_init1(IN_NONBLOCK);
+    if (level->watch_fd >= 0 && inotify_add_watch(level->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(level->watch_fd);
+        level->watch_fd = -1;
+    }
+#endif
+}
+
+bool L_Load(level_t *level, const char *path)
+{
+    level->path = path;
+    level->num_sectors = 0;
+
+    int n;
+    if (!L_Parse(path, &n))
+        return false;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (R_AddSectorToQueue(&parsed_sectors[i]) < 0)
+            return false;
+
+        level->hashes[i] = parsed_hashes[i];
+    }
+
+    level->num_sectors = n;
+    L_WatchInit(level);
+
+    return true;
+}
+
+// re-read the level and rebuild the sectors whose records changed. the
+// renderer and the player keep running on the old level if parsing fails
+void L_Reload(level_t *level)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    int n;
+    if (!L_Parse(level->path, &n))
+    {
+        printf("Keeping the current level\n");
+        return;
+    }
+
+    int rebuilt = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (i < level->num_sectors && level->hashes[i] == parsed_hashes[i])
+            continue;
+
+        // a sector that cannot be replaced keeps its old geometry and is
+        // tried again on the next reload
+        if (i < level->num_sectors)
+        {
+            if (!R_ReplaceSector(i, &parsed_sectors[i]))
+            {
+                printf("Error rebuilding sector %d, keeping it\n", i);
+                continue;
+            }
+        }
+        else if (R_AddSectorToQueue(&parsed_sectors[i]) < 0)
+        {
+            printf("Error adding sector %d, dropping it and the ones after it\n", i);
+            n = i;
+            break;
+        }
+
+        level->hashes[i] = parsed_hashes[i];
+        rebuilt++;
+    }
+
+    if (n < level->num_sectors)
+        R_TruncateSectors(n);
+
+    double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    printf("Reloaded %s: %d of %d sectors rebuilt, %d removed (%.2f ms)\n",
+           level->path, rebuilt, n, level->num_sectors > n ? level->num_sectors - n : 0, ms);
+
+    level->num_sectors = n;
+}
+
+// call once per frame, reloads the level after it was saved
+void L_Watch(level_t *level)
+{
+    bool changed = false;
+
+#ifdef __linux__
+    if (level->watch_fd >= 0)
+    {
+        const char *name = strrchr(level->path, '/');
+        name = name != NULL ? name + 1 : level->path;
+
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(level->watch_fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + len;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if (ev->len > 0 && strcmp(ev->name, name) == 0)
+                    changed = true;
+
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+
+        if (changed)
+            L_Reload(level);
+
+        return;
+    }
+#endif
+
+    // no inotify, poll the file's stamp a few times per second
+    unsigned int now = SDL_GetTicks();
+    if (now - level->last_poll < L_POLL_INTERVAL)
+        return;
+
+    level->last_poll = now;
+
+    time_t mtime;
+    long size;
+    L_ReadFileStamp(level, &mtime, &size);
+    changed = mtime != level->mtime || size != level->size;
+
+    if (changed)
+    {
+        level->mtime = mtime;
+        level->size = size;
+        L_Reload(level);
+    }
+}
+
+void L_Shutdown(level_t *level)
+{
+#ifdef __linux__
+    if (level->watch_fd >= 0)
+        close(level->watch_fd);
+#endif
+
+    level->watch_fd = -1;
+}
@@ -0,0 +1,32 @@
+#ifndef L_LEVEL_H
+#define L_LEVEL_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "typedefs.h"
+#include "r_renderer.h"
+
+#define L_MAX_SECTORS 1024
+
+typedef struct _level
+{
+    const char *path;
+
+    // hash of every sector's records, a reload only rebuilds sectors whose
+    // hash changed
+    unsigned int hashes[L_MAX_SECTORS];
+    int num_sectors;
+
+    // inotify on linux, mtime polling elsewhere
+    int watch_fd;
+    time_t mtime;
+    long size;
+    unsigned int last_poll;
+} level_t;
+
+bool L_Load(level_t *level, const char *path);
+void L_Watch(level_t *level);
+void L_Shutdown(level_t *level);
+
+#endif /* L_LEVEL_H */
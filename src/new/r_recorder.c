@@ -0,0 +1,282 @@
+#include "r_recorder.h"
+#include "r_renderer.h"
+
+#define R_REPLAY_SPEED 100.0 // commands per second, the old debug pace
+#define R_REPLAY_SPEED_MAX 1000000.0
+
+#define HIGHLIGHT_CLR 0xFFFF00FF
+#define QUAD_CLR 0xFFFFFFFF
+#define BAR_CLR 0xFF202020
+#define BAR_DONE_CLR 0xFF606060
+#define BAR_CURSOR_CLR 0xFFFFFFFF
+
+recorder_t recorder = {.speed = R_REPLAY_SPEED};
+Uint64 record_start = 0;
+
+void R_RecorderStart(bool is_occluding)
+{
+    recorder.num_cmds = 0;
+    recorder.is_recording = true;
+    recorder.is_occluding = is_occluding;
+    record_start = SDL_GetPerformanceCounter();
+}
+
+void R_RecorderStop()
+{
+    recorder.is_recording = false;
+    recorder.has_frame = true;
+    recorder.record_ms = (SDL_GetPerformanceCounter() - record_start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    // start on the finished frame, stepping back shows how it was built
+    recorder.cursor = recorder.num_cmds;
+    recorder.is_playing = false;
+    recorder.pending = 0;
+}
+
+// forget the frame, the next debug frame records a new one
+void R_RecorderDrop()
+{
+    recorder.is_recording = false;
+    recorder.has_frame = false;
+    recorder.is_scrubbing = false;
+}
+
+void R_RecorderShutdown()
+{
+    free(recorder.cmds);
+    recorder.cmds = NULL;
+    recorder.num_cmds = 0;
+    recorder.capacity = 0;
+}
+
+bool R_RecorderHasFrame()
+{
+    return recorder.has_frame;
+}
+
+bool R_RecorderIsOccluding()
+{
+    return recorder.is_occluding;
+}
+
+void R_Record(draw_cmd_type_t type, unsigned int color, int v0, int v1, int v2, int v3, int v4, int v5)
+{
+    if (!recorder.is_recording)
+        return;
+
+    if (recorder.num_cmds == recorder.capacity)
+    {
+        int capacity = recorder.capacity ? recorder.capacity * 2 : 4096;
+        draw_cmd_t *cmds = realloc(recorder.cmds, capacity * sizeof(draw_cmd_t));
+        if (cmds == NULL)
+        {
+            printf("Error growing draw command buffer!\n");
+            recorder.is_recording = false;
+            return;
+        }
+
+        recorder.cmds = cmds;
+        recorder.capacity = capacity;
+    }
+
+    draw_cmd_t *c = &recorder.cmds[recorder.num_cmds++];
+    c->type = type;
+    c->color = color;
+    c->v[0] = v0;
+    c->v[1] = v1;
+    c->v[2] = v2;
+    c->v[3] = v3;
+    c->v[4] = v4;
+    c->v[5] = v5;
+}
+
+void R_InspectorSetCursor(int cursor)
+{
+    if (cursor < 0) cursor = 0;
+    if (cursor > recorder.num_cmds) cursor = recorder.num_cmds;
+
+    recorder.cursor = cursor;
+}
+
+void R_InspectorStep(int delta)
+{
+    recorder.is_playing = false;
+    R_InspectorSetCursor(recorder.cursor + delta);
+}
+
+// jump to the start of the next or previous sector
+void R_InspectorStepSector(int delta)
+{
+    recorder.is_playing = false;
+
+    int i = recorder.cursor;
+    do
+    {
+        i += delta;
+    } while (i > 0 && i < recorder.num_cmds && recorder.cmds[i - 1].type != RC_SECTOR);
+
+    R_InspectorSetCursor(i);
+}
+
+void R_InspectorTogglePlay()
+{
+    // playing from the end starts over
+    if (!recorder.is_playing && recorder.cursor == recorder.num_cmds)
+        recorder.cursor = 0;
+
+    recorder.is_playing = !recorder.is_playing;
+    recorder.pending = 0;
+}
+
+void R_InspectorSpeed(double factor)
+{
+    recorder.speed *= factor;
+    if (recorder.speed < 1) recorder.speed = 1;
+    if (recorder.speed > R_REPLAY_SPEED_MAX) recorder.speed = R_REPLAY_SPEED_MAX;
+}
+
+// a press on the scrubber bar grabs it, the cursor follows until release
+void R_InspectorMouse(int x, int y, bool is_down, bool is_drag)
+{
+    if (!is_drag)
+        recorder.is_scrubbing = is_down && y >= recorder.bar_y;
+
+    if (!recorder.is_scrubbing || recorder.bar_w <= 0)
+        return;
+
+    recorder.is_playing = false;
+    R_InspectorSetCursor((int)((double)x * recorder.num_cmds / (recorder.bar_w - 1) + 0.5));
+}
+
+void R_InspectorUpdate(double dt)
+{
+    if (!recorder.is_playing)
+        return;
+
+    recorder.pending += recorder.speed * dt;
+    int n = (int)recorder.pending;
+    recorder.pending -= n;
+
+    R_InspectorSetCursor(recorder.cursor + n);
+    if (recorder.cursor == recorder.num_cmds)
+        recorder.is_playing = false;
+}
+
+void R_ReplayCommand(draw_cmd_t *c, unsigned int color)
+{
+    switch (c->type)
+    {
+    case RC_VSPAN:
+        R_DrawVSpan(c->v[0], c->v[1], c->v[2], color);
+        break;
+
+    case RC_HSPAN:
+        R_DrawHSpan(c->v[0], c->v[1], c->v[2], color);
+        break;
+
+    case RC_LINE:
+        R_DrawLine(c->v[0], c->v[1], c->v[2], c->v[3], color);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// redraw the frame as it was after `cursor` commands, on a screen the
+// renderer cleared for the recorded mode
+void R_InspectorReplay()
+{
+    for (int i = 0; i < recorder.cursor; i++)
+        R_ReplayCommand(&recorder.cmds[i], recorder.cmds[i].color);
+}
+
+void R_DrawQuadOutline(draw_cmd_t *c, unsigned int color)
+{
+    R_DrawLine(c->v[0], c->v[2], c->v[1], c->v[4], color);
+    R_DrawLine(c->v[0], c->v[3], c->v[1], c->v[5], color);
+    R_DrawLine(c->v[0], c->v[2], c->v[0], c->v[3], color);
+    R_DrawLine(c->v[1], c->v[4], c->v[1], c->v[5], color);
+}
+
+// outline the quad being rasterized, flash the last command and draw the
+// scrubber with a tick at every sector start
+void R_InspectorDrawOverlay(int w, int h)
+{
+    int last = recorder.cursor - 1;
+
+    for (int i = last; i >= 0; i--)
+    {
+        if (recorder.cmds[i].type == RC_SECTOR)
+            break;
+
+        if (recorder.cmds[i].type == RC_QUAD)
+        {
+            R_DrawQuadOutline(&recorder.cmds[i], QUAD_CLR);
+            break;
+        }
+    }
+
+    if (last >= 0)
+        R_ReplayCommand(&recorder.cmds[last], HIGHLIGHT_CLR);
+
+    recorder.bar_w = w;
+    recorder.bar_y = h - R_SCRUBBER_H;
+
+    int cursor_x = recorder.num_cmds ? (int)((double)recorder.cursor * (w - 1) / recorder.num_cmds) : 0;
+    for (int y = recorder.bar_y; y < h; y++)
+    {
+        R_DrawHSpan(y, 0, w - 1, BAR_CLR);
+        R_DrawHSpan(y, 0, cursor_x, BAR_DONE_CLR);
+    }
+
+    for (int i = 0; i < recorder.num_cmds; i++)
+    {
+        if (recorder.cmds[i].type != RC_SECTOR)
+            continue;
+
+        int x = (int)((double)i * (w - 1) / recorder.num_cmds);
+        R_DrawVSpan(x, recorder.bar_y + R_SCRUBBER_H / 2, h - 1, recorder.cmds[i].color);
+    }
+
+    R_DrawVSpan(cursor_x, recorder.bar_y, h - 1, BAR_CURSOR_CLR);
+}
+
+const char *R_CommandName(draw_cmd_type_t type)
+{
+    switch (type)
+    {
+    case RC_VSPAN: return "vspan";
+    case RC_HSPAN: return "hspan";
+    case RC_LINE: return "line";
+    case RC_QUAD: return "quad";
+    case RC_SECTOR: return "sector";
+    default: return "?";
+    }
+}
+
+void R_InspectorTitle(SDL_Window *window)
+{
+    int sector = -1;
+    for (int i = recorder.cursor - 1; i >= 0; i--)
+    {
+        if (recorder.cmds[i].type == RC_SECTOR)
+        {
+            sector = recorder.cmds[i].v[0];
+            break;
+        }
+    }
+
+    char cmd[64] = "start";
+    if (recorder.cursor > 0)
+    {
+        draw_cmd_t *c = &recorder.cmds[recorder.cursor - 1];
+        snprintf(cmd, sizeof(cmd), "%s %d %d %d %d", R_CommandName(c->type), c->v[0], c->v[1], c->v[2], c->v[3]);
+    }
+
+    char title[192];
+    snprintf(title, sizeof(title), "inspector: %d/%d %s, sector %d, %s %.0f cmd/s, recorded in %.2f ms",
+             recorder.cursor, recorder.num_cmds, cmd, sector,
+             recorder.is_playing ? "playing" : "paused", recorder.speed, recorder.record_ms);
+    SDL_SetWindowTitle(window, title);
+}
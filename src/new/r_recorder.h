@@ -0,0 +1,68 @@
+#ifndef R_RECORDER_H
+#define R_RECORDER_H
+
+#define SDL_MAIN_HANDLED
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+
+#include "typedefs.h"
+
+#define R_SCRUBBER_H 6 // rows of the scrubber bar at the bottom
+
+typedef enum
+{
+    RC_VSPAN,  // x, y0, y1
+    RC_HSPAN,  // y, x0, x1
+    RC_LINE,   // x0, y0, x1, y1
+    RC_QUAD,   // ax, bx, at, ab, bt, bb, only marks the quad's outline
+    RC_SECTOR  // id, handle, starts a sector's commands
+} draw_cmd_type_t;
+
+typedef struct _draw_cmd
+{
+    unsigned int color;
+    int v[6];
+    unsigned char type;
+} draw_cmd_t;
+
+// the draw commands of one frame. debug mode records a frame at full speed
+// and the inspector replays its first `cursor` commands
+typedef struct _recorder
+{
+    draw_cmd_t *cmds;
+    int num_cmds;
+    int capacity;
+
+    bool is_recording;
+    bool has_frame;
+    bool is_occluding; // the frame was drawn front-to-back
+    double record_ms;
+
+    int cursor;
+    bool is_playing;
+    bool is_scrubbing;
+    double speed;   // commands per second while playing
+    double pending; // commands owed to the next frame
+    int bar_w, bar_y; // scrubber placement, for the mouse
+} recorder_t;
+
+void R_RecorderStart(bool is_occluding);
+void R_RecorderStop();
+void R_RecorderDrop();
+void R_RecorderShutdown();
+bool R_RecorderHasFrame();
+bool R_RecorderIsOccluding();
+void R_Record(draw_cmd_type_t type, unsigned int color, int v0, int v1, int v2, int v3, int v4, int v5);
+
+void R_InspectorStep(int delta);
+void R_InspectorStepSector(int delta);
+void R_InspectorTogglePlay();
+void R_InspectorSpeed(double factor);
+void R_InspectorMouse(int x, int y, bool is_down, bool is_drag);
+void R_InspectorUpdate(double dt);
+void R_InspectorReplay();
+void R_InspectorDrawOverlay(int w, int h);
+void R_InspectorTitle(SDL_Window *window);
+
+#endif /* R_RECORDER_H */
@@ -1,8 +1,11 @@
 #include "r_renderer.h"
+#include "r_recorder.h"
 
-#define IS_CEIL 1
-#define IS_FLOOR 2
-#define IS_WALL 0
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define CEIL_CLR 0x3ac960
 #define FLOOR_CLR 0x1a572a
@@ -17,6 +20,32 @@ unsigned int *screen_buffer = NULL;
 int screen_buffer_size = 0;
 
 sectors_queue_t sectors_queue;
+arena_t frame_arena;
+vertex_pool_t vertex_pool;
+mesh_t mesh;
+unsigned int lut_generation = 0;
+
+// front-to-back mode: a pixel is only written while its coverage byte is
+// clear, col_top/col_bot are the first and last uncovered rows per column
+bool is_occluding = false;
+unsigned char *coverage = NULL;
+int col_top[R_MAX_SCRNW];
+int col_bot[R_MAX_SCRNW];
+
+// overdraw heat map, counts writes per pixel
+bool is_counting_overdraw = false;
+unsigned char *overdraw = NULL;
+
+render_stats_t render_stats;
+
+// wall columns of the current sector, drawn after its caps when occluding
+typedef struct _wall_span
+{
+    short x, y1, y2;
+} wall_span_t;
+
+wall_span_t wall_spans[20 * R_MAX_SCRNW];
+int num_wall_spans = 0;
 
 typedef struct _rquad
 {
@@ -32,12 +61,381 @@ void R_ShutdownScreen()
 
     if (screen_buffer != NULL)
         free(screen_buffer);
+
+    free(coverage);
+    free(overdraw);
 }
 
 void R_Shutdown()
 {
     R_ShutdownScreen();
     SDL_DestroyRenderer(sdl_renderer);
+
+    free(frame_arena.base);
+    free(sectors_queue.sectors);
+    free(sectors_queue.order);
+
+    free(vertex_pool.x);
+    free(vertex_pool.y);
+    free(vertex_pool.vx);
+    free(vertex_pool.vz);
+    free(vertex_pool.table);
+
+    free(mesh.edges);
+    free(mesh.table);
+
+    R_RecorderShutdown();
+}
+
+unsigned int R_HashVertex(double x, double y)
+{
+    Uint64 bits[2];
+    memcpy(&bits[0], &x, sizeof(double));
+    memcpy(&bits[1], &y, sizeof(double));
+
+    return ((unsigned int)(bits[0] ^ bits[0] >> 32) * 73856093u) ^
+           ((unsigned int)(bits[1] ^ bits[1] >> 32) * 19349663u);
+}
+
+void R_VertexTableInsert(int index)
+{
+    unsigned int mask = vertex_pool.table_size - 1;
+    unsigned int h = R_HashVertex(vertex_pool.x[index], vertex_pool.y[index]) & mask;
+
+    while (vertex_pool.table[h] != -1)
+        h = (h + 1) & mask;
+
+    vertex_pool.table[h] = index;
+}
+
+// index of the pool vertex at p, added if it is not there yet. -1 if the
+// pool cannot grow
+int R_InternVertex(vec2_t p)
+{
+    double x = p.x;
+    double y = p.y;
+
+    if (vertex_pool.table_size > 0)
+    {
+        unsigned int mask = vertex_pool.table_size - 1;
+        for (unsigned int h = R_HashVertex(x, y) & mask; vertex_pool.table[h] != -1; h = (h + 1) & mask)
+        {
+            int i = vertex_pool.table[h];
+            if (vertex_pool.x[i] == x && vertex_pool.y[i] == y)
+                return i;
+        }
+    }
+
+    if (vertex_pool.num_vertices == vertex_pool.capacity)
+    {
+        int capacity = vertex_pool.capacity ? vertex_pool.capacity * 2 : 64;
+        double **arrays[4] = {&vertex_pool.x, &vertex_pool.y, &vertex_pool.vx, &vertex_pool.vz};
+        for (int k = 0; k < 4; k++)
+        {
+            double *a = realloc(*arrays[k], capacity * sizeof(double));
+            if (a == NULL)
+            {
+                printf("Error growing vertex pool!\n");
+                return -1;
+            }
+
+            *arrays[k] = a;
+        }
+
+        vertex_pool.capacity = capacity;
+    }
+
+    int i = vertex_pool.num_vertices++;
+    vertex_pool.x[i] = x;
+    vertex_pool.y[i] = y;
+
+    // keep the table at most half full
+    if (vertex_pool.num_vertices * 2 > vertex_pool.table_size)
+    {
+        int size = vertex_pool.table_size ? vertex_pool.table_size * 2 : 128;
+        int *table = realloc(vertex_pool.table, size * sizeof(int));
+        if (table == NULL)
+        {
+            printf("Error growing vertex table!\n");
+            return i;
+        }
+
+        vertex_pool.table = table;
+        vertex_pool.table_size = size;
+        memset(table, -1, size * sizeof(int));
+
+        for (int k = 0; k < vertex_pool.num_vertices; k++)
+            R_VertexTableInsert(k);
+    }
+    else
+    {
+        R_VertexTableInsert(i);
+    }
+
+    return i;
+}
+
+bool R_InternSectorVertices(sector_t *s)
+{
+    for (int k = 0; k < s->num_walls; k++)
+    {
+        s->walls[k].va = R_InternVertex(s->walls[k].a);
+        s->walls[k].vb = R_InternVertex(s->walls[k].b);
+
+        if (s->walls[k].va < 0 || s->walls[k].vb < 0)
+            return false;
+    }
+
+    return true;
+}
+
+unsigned int R_HashEdge(int va, int vb)
+{
+    return (unsigned int)va * 73856093u ^ (unsigned int)vb * 83492791u;
+}
+
+// edge running from va to vb, -1 if there is none. edges of removed
+// sectors stay in the table but never match
+int R_FindEdge(int va, int vb)
+{
+    if (mesh.table_size == 0)
+        return -1;
+
+    unsigned int mask = mesh.table_size - 1;
+    for (unsigned int h = R_HashEdge(va, vb) & mask; mesh.table[h] != -1; h = (h + 1) & mask)
+    {
+        half_edge_t *e = &mesh.edges[mesh.table[h]];
+        if (e->sector >= 0 && e->v == va && mesh.edges[e->next].v == vb)
+            return mesh.table[h];
+    }
+
+    return -1;
+}
+
+void R_EdgeTableInsert(int index)
+{
+    half_edge_t *e = &mesh.edges[index];
+    unsigned int mask = mesh.table_size - 1;
+    unsigned int h = R_HashEdge(e->v, mesh.edges[e->next].v) & mask;
+
+    while (mesh.table[h] != -1)
+        h = (h + 1) & mask;
+
+    mesh.table[h] = index;
+}
+
+wall_t *R_EdgeWall(half_edge_t *e)
+{
+    return &sectors_queue.sectors[e->sector].walls[e->wall];
+}
+
+// a solid wall is buried if the solid wall on the other side belongs to a
+// neighbour spanning at least the same heights, it can never be seen
+bool R_IsBuried(half_edge_t *e, half_edge_t *twin)
+{
+    wall_t *w = R_EdgeWall(e);
+    wall_t *tw = R_EdgeWall(twin);
+    if (w->is_portal || tw->is_portal)
+        return false;
+
+    sector_t *s = &sectors_queue.sectors[e->sector];
+    sector_t *nb = &sectors_queue.sectors[twin->sector];
+
+    return nb->elevation <= s->elevation &&
+           nb->elevation + nb->height >= s->elevation + s->height;
+}
+
+// add the edge loop of a queued sector and link it with its neighbours
+void R_MeshAddSector(int handle)
+{
+    sector_t *s = &sectors_queue.sectors[handle];
+    s->first_edge = mesh.num_edges;
+
+    if (mesh.num_edges + s->num_walls > mesh.capacity)
+    {
+        int capacity = mesh.capacity ? mesh.capacity * 2 : 64;
+        while (capacity < mesh.num_edges + s->num_walls)
+            capacity *= 2;
+
+        half_edge_t *edges = realloc(mesh.edges, capacity * sizeof(half_edge_t));
+        if (edges == NULL)
+        {
+            // the sector is drawn without links, none of its walls buried
+            printf("Error growing mesh!\n");
+            s->first_edge = -1;
+            for (int k = 0; k < s->num_walls; k++)
+                s->walls[k].is_buried = false;
+            return;
+        }
+
+        mesh.edges = edges;
+        mesh.capacity = capacity;
+    }
+
+    for (int k = 0; k < s->num_walls; k++)
+    {
+        half_edge_t *e = &mesh.edges[s->first_edge + k];
+        e->v = s->walls[k].va;
+        e->twin = -1;
+        e->sector = handle;
+        e->wall = k;
+        s->walls[k].is_buried = false;
+    }
+
+    // the loop follows shared endpoints, walls are usually listed in order
+    for (int k = 0; k < s->num_walls; k++)
+    {
+        half_edge_t *e = &mesh.edges[s->first_edge + k];
+        e->next = s->first_edge + (k + 1) % s->num_walls;
+
+        for (int j = 0; j < s->num_walls; j++)
+        {
+            if (s->walls[j].va == s->walls[k].vb)
+            {
+                e->next = s->first_edge + j;
+                break;
+            }
+        }
+    }
+
+    mesh.num_edges += s->num_walls;
+
+    // keep the table at most half full
+    if (mesh.num_edges * 2 > mesh.table_size)
+    {
+        int size = mesh.table_size ? mesh.table_size * 2 : 128;
+        while (size < mesh.num_edges * 2)
+            size *= 2;
+
+        int *table = realloc(mesh.table, size * sizeof(int));
+        if (table == NULL)
+        {
+            printf("Error growing mesh table!\n");
+            return;
+        }
+
+        mesh.table = table;
+        mesh.table_size = size;
+        memset(table, -1, size * sizeof(int));
+
+        for (int i = 0; i < mesh.num_edges - s->num_walls; i++)
+        {
+            if (mesh.edges[i].sector >= 0)
+                R_EdgeTableInsert(i);
+        }
+    }
+
+    for (int k = 0; k < s->num_walls; k++)
+    {
+        int index = s->first_edge + k;
+        half_edge_t *e = &mesh.edges[index];
+        int twin = R_FindEdge(mesh.edges[e->next].v, e->v);
+
+        R_EdgeTableInsert(index);
+
+        if (twin < 0 || mesh.edges[twin].twin != -1)
+            continue;
+
+        e->twin = twin;
+        mesh.edges[twin].twin = index;
+        R_EdgeWall(e)->is_buried = R_IsBuried(e, &mesh.edges[twin]);
+        R_EdgeWall(&mesh.edges[twin])->is_buried = R_IsBuried(&mesh.edges[twin], e);
+    }
+}
+
+// take a sector's edge loop out of the mesh. only its neighbours are
+// touched: their walls lose the twin and are not buried any more. the dead
+// edges keep their slots until the mesh is rebuilt
+void R_MeshRemoveSector(int handle)
+{
+    sector_t *s = &sectors_queue.sectors[handle];
+    if (s->first_edge < 0)
+        return;
+
+    for (int k = 0; k < s->num_walls; k++)
+    {
+        half_edge_t *e = &mesh.edges[s->first_edge + k];
+        if (e->twin >= 0)
+        {
+            mesh.edges[e->twin].twin = -1;
+            R_EdgeWall(&mesh.edges[e->twin])->is_buried = false;
+        }
+
+        e->twin = -1;
+        e->sector = -1;
+    }
+}
+
+// move every pool vertex into view space, sin/cos are taken once a frame.
+// done in doubles like the per-wall transform it replaced, so frames come
+// out the same
+void R_TransformVertices(player_t *player)
+{
+    double sn = sin(player->dir_angle);
+    double cn = cos(player->dir_angle);
+    double px = player->position.x;
+    double py = player->position.y;
+    int n = vertex_pool.num_vertices;
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128d vsn = _mm_set1_pd(sn);
+    __m128d vcn = _mm_set1_pd(cn);
+    __m128d vpx = _mm_set1_pd(px);
+    __m128d vpy = _mm_set1_pd(py);
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(vertex_pool.x + i), vpx);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(vertex_pool.y + i), vpy);
+        _mm_storeu_pd(vertex_pool.vx + i, _mm_sub_pd(_mm_mul_pd(dx, vsn), _mm_mul_pd(dy, vcn)));
+        _mm_storeu_pd(vertex_pool.vz + i, _mm_add_pd(_mm_mul_pd(dx, vcn), _mm_mul_pd(dy, vsn)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float64x2_t vsn = vdupq_n_f64(sn);
+    float64x2_t vcn = vdupq_n_f64(cn);
+    float64x2_t vpx = vdupq_n_f64(px);
+    float64x2_t vpy = vdupq_n_f64(py);
+    for (; i + 2 <= n; i += 2)
+    {
+        float64x2_t dx = vsubq_f64(vld1q_f64(vertex_pool.x + i), vpx);
+        float64x2_t dy = vsubq_f64(vld1q_f64(vertex_pool.y + i), vpy);
+        vst1q_f64(vertex_pool.vx + i, vsubq_f64(vmulq_f64(dx, vsn), vmulq_f64(dy, vcn)));
+        vst1q_f64(vertex_pool.vz + i, vaddq_f64(vmulq_f64(dx, vcn), vmulq_f64(dy, vsn)));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        double dx = vertex_pool.x[i] - px;
+        double dy = vertex_pool.y[i] - py;
+        vertex_pool.vx[i] = dx * sn - dy * cn;
+        vertex_pool.vz[i] = dx * cn + dy * sn;
+    }
+}
+
+// make sure the arena holds at least size bytes and empty it. new memory is
+// zeroed so LUT generation stamps in it never match
+void R_ArenaReset(arena_t *arena, size_t size)
+{
+    if (arena->size < size)
+    {
+        free(arena->base);
+        arena->base = calloc(1, size);
+        arena->size = arena->base != NULL ? size : 0;
+    }
+
+    arena->used = 0;
+}
+
+void *R_ArenaAlloc(arena_t *arena, size_t size)
+{
+    if (arena->used + size > arena->size)
+        return NULL;
+
+    void *p = arena->base + arena->used;
+    arena->used += size;
+
+    return p;
 }
 
 void R_UpdateScreen()
@@ -60,6 +458,14 @@ void R_InitScreen(int w, int h)
 
     memset(screen_buffer, 0, screen_buffer_size);
 
+    coverage = malloc(w * h);
+    overdraw = malloc(w * h);
+    if (coverage == NULL || overdraw == NULL)
+    {
+        printf("Error initializing coverage buffers!\n");
+        R_Shutdown();
+    }
+
     screen_texture = SDL_CreateTexture(
         sdl_renderer,
         SDL_PIXELFORMAT_RGBA32,
@@ -78,6 +484,8 @@ void R_Init(SDL_Window *main_win, game_state_t *game_state)
 {
     window = main_win;
     scrnw = game_state->scrn_w / 2;
+    if (scrnw > R_MAX_SCRNW)
+        scrnw = R_MAX_SCRNW;
     scrnh = game_state->scrn_h / 2;
 
     sdl_renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
@@ -85,19 +493,160 @@ void R_Init(SDL_Window *main_win, game_state_t *game_state)
     SDL_RenderSetLogicalSize(sdl_renderer, scrnw, scrnh);
 }
 
+// move the open rows of column x past rows covered at its ends
+void R_ShrinkColumn(int x)
+{
+    while (col_top[x] <= col_bot[x] && coverage[scrnw * col_top[x] + x])
+        col_top[x]++;
+
+    while (col_bot[x] >= col_top[x] && coverage[scrnw * col_bot[x] + x])
+        col_bot[x]--;
+}
+
+// write a pixel unless it is already covered, returns true if written
+bool R_PutPixel(int x, int y, unsigned int color)
+{
+    int i = scrnw * y + x;
+
+    if (is_occluding)
+    {
+        if (coverage[i])
+            return false;
+
+        coverage[i] = 1;
+    }
+
+    screen_buffer[i] = color;
+    render_stats.pixels_written++;
+
+    if (is_counting_overdraw && overdraw[i] < 255)
+        overdraw[i]++;
+
+    return true;
+}
+
 void R_DrawPoint(int x, int y, unsigned int color)
 {
-    bool is_out_of_bounds = (x < 0 || x > scrnw || y < 0 || y >= scrnh);
+    bool is_out_of_bounds = (x < 0 || x >= (int)scrnw || y < 0 || y >= (int)scrnh);
     bool is_outside_mem_buff = (scrnw * y + x) >= (scrnw * scrnh);
 
     if (is_out_of_bounds || is_outside_mem_buff)
         return;
 
-    screen_buffer[scrnw * y + x] = color;
+    if (R_PutPixel(x, y, color) && is_occluding)
+        R_ShrinkColumn(x);
+}
+
+// vertical span [y0..y1] at column x, clipped once against the screen
+void R_DrawVSpan(int x, int y0, int y1, unsigned int color)
+{
+    if (y0 > y1)
+    {
+        int t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+
+    if (x < 0 || x >= (int)scrnw || y1 < 0 || y0 >= (int)scrnh)
+        return;
+
+    R_Record(RC_VSPAN, color, x, y0, y1, 0, 0, 0);
+
+    if (y0 < 0) y0 = 0;
+    if (y1 > (int)scrnh - 1) y1 = scrnh - 1;
+
+    if (is_occluding || is_counting_overdraw)
+    {
+        // rows outside the open range are covered already
+        if (is_occluding)
+        {
+            if (y0 < col_top[x]) y0 = col_top[x];
+            if (y1 > col_bot[x]) y1 = col_bot[x];
+        }
+
+        for (int y = y0; y <= y1; y++)
+            R_PutPixel(x, y, color);
+
+        if (is_occluding)
+            R_ShrinkColumn(x);
+    }
+    else
+    {
+        unsigned int *p = &screen_buffer[scrnw * y0 + x];
+        for (int y = y0; y <= y1; y++, p += scrnw)
+            *p = color;
+
+        if (y1 >= y0)
+            render_stats.pixels_written += y1 - y0 + 1;
+    }
+}
+
+// horizontal span [x0..x1] on row y, clipped once against the screen
+void R_DrawHSpan(int y, int x0, int x1, unsigned int color)
+{
+    if (x0 > x1)
+    {
+        int t = x0;
+        x0 = x1;
+        x1 = t;
+    }
+
+    if (y < 0 || y >= (int)scrnh || x1 < 0 || x0 >= (int)scrnw)
+        return;
+
+    R_Record(RC_HSPAN, color, y, x0, x1, 0, 0, 0);
+
+    if (x0 < 0) x0 = 0;
+    if (x1 > (int)scrnw - 1) x1 = scrnw - 1;
+
+    if (is_occluding || is_counting_overdraw)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            if (R_PutPixel(x, y, color) && is_occluding)
+                R_ShrinkColumn(x);
+        }
+
+        return;
+    }
+
+    unsigned int *p = &screen_buffer[scrnw * y + x0];
+    int n = x1 - x0 + 1;
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128i c = _mm_set1_epi32((int)color);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(p + i), c);
+#elif defined(__ARM_NEON)
+    uint32x4_t c = vdupq_n_u32(color);
+    for (; i + 4 <= n; i += 4)
+        vst1q_u32(p + i, c);
+#endif
+
+    for (; i < n; i++)
+        p[i] = color;
+
+    render_stats.pixels_written += n;
 }
 
 void R_DrawLine(int x0, int y0, int x1, int y1, unsigned int color)
 {
+    // axis aligned lines do not need bresenham
+    if (x0 == x1)
+    {
+        R_DrawVSpan(x0, y0, y1, color);
+        return;
+    }
+
+    if (y0 == y1)
+    {
+        R_DrawHSpan(y0, x0, x1, color);
+        return;
+    }
+
+    R_Record(RC_LINE, color, x0, y0, x1, y1, 0, 0);
+
     int dx;
     if (x1 > x0)
         dx = x1 - x0;
@@ -134,12 +683,6 @@ void R_DrawLine(int x0, int y0, int x1, int y1, unsigned int color)
             y0 += sy;
         }
     }
-
-    if (is_debug_mode)
-    {
-        R_UpdateScreen();
-        SDL_Delay(10);
-    }
 }
 
 void R_ClearScreenBuffer()
@@ -162,30 +705,6 @@ void R_SwapQuadPoints(rquad_t *q)
     q->ab = t;
 }
 
-void R_CalcInterpolationFactors(rquad_t q, double *delta_height, double *delta_elevation)
-{
-    // absolute width
-    int width = abs(q.ax - q.bx);
-    if (width == 0)
-    {
-        *delta_height = -1;
-        *delta_elevation = -1;
-        return;
-    }
-
-    // calc height increment
-    int a_height = q.ab - q.at;
-    int b_height = q.bb - q.bt;
-
-    *delta_height = (double)(b_height - a_height) / (double)width;
-
-    // get player's view elevation from the floor
-    int y_center_a = (q.ab - (a_height / 2));
-    int y_center_b = (q.bb - (b_height / 2));
-
-    *delta_elevation = (y_center_b - y_center_a) / (double)width;
-}
-
 int R_CapToScreenH(int val)
 {
     if (val < 0) val = 0;
@@ -202,60 +721,116 @@ int R_CapToScreenW(int val)
     return val;
 }
 
-void R_Rasterize(rquad_t q, uint32_t color, int ceil_floor_wall, plane_lut_t *xy_lut)
+void R_LutWrite(plane_lut_t *lut, int x, int y, bool is_bottom)
 {
-    // if backfacing wall then do not rasterize
-    if (ceil_floor_wall == IS_WALL && q.ax > q.bx)
-        return;
+    if (is_bottom)
+    {
+        lut->b[x] = y;
+        lut->b_gen[x] = lut_generation;
+    }
+    else
+    {
+        lut->t[x] = y;
+        lut->t_gen[x] = lut_generation;
+    }
+
+    if (x < lut->x_min) lut->x_min = x;
+    if (x > lut->x_max) lut->x_max = x;
+}
+
+int R_LutTop(plane_lut_t *lut, int x)
+{
+    return lut->t_gen[x] == lut_generation ? lut->t[x] : 0;
+}
+
+int R_LutBottom(plane_lut_t *lut, int x)
+{
+    return lut->b_gen[x] == lut_generation ? lut->b[x] : 0;
+}
+
+// start a new LUT generation, making every entry written so far stale
+void R_LutBeginSector(sector_luts_t *l)
+{
+    if (++lut_generation == 0)
+    {
+        // wrapped around, old stamps could match again
+        memset(frame_arena.base, 0, frame_arena.size);
+        lut_generation = 1;
+    }
+
+    plane_lut_t *luts[4] = {
+        &l->portals_floorx_ylut, &l->portals_ceilx_ylut,
+        &l->floorx_ylut, &l->ceilx_ylut
+    };
+
+    for (int i = 0; i < 4; i++)
+    {
+        luts[i]->x_min = scrnw;
+        luts[i]->x_max = -1;
+    }
+}
+
+// 16.16 fixed point to int, truncating toward zero like a double cast
+int R_FixedToInt(int64_t v)
+{
+    return v >= 0 ? (int)(v >> 16) : -(int)((-v) >> 16);
+}
+
+// walk the columns of a quad once: record its top and bottom edge in the
+// ceiling and floor LUTs and, if it faces the player, draw the wall span.
+// back facing and buried quads only bound the caps, back facing ones go to
+// the LUTs' bottom entries
+void R_RasterizeQuad(rquad_t q, uint32_t color, plane_lut_t *ceil_lut, plane_lut_t *floor_lut, bool draw_wall)
+{
+    R_Record(RC_QUAD, color, q.ax, q.bx, q.at, q.ab, q.bt, q.bb);
 
     bool is_back_wall = false;
 
-    if ((ceil_floor_wall != IS_WALL) && q.ax > q.bx)
+    if (q.ax > q.bx)
     {
         R_SwapQuadPoints(&q);
         is_back_wall = true;
     }
 
-    double delta_height, delta_elevation;
-
-    R_CalcInterpolationFactors(q, &delta_height, &delta_elevation);
-    if (delta_height == -1 && delta_elevation == -1)
+    int width = q.bx - q.ax;
+    if (width == 0)
         return;
 
-    for (int x = q.ax, i = 1; x < q.bx; x++, i++)
+    // edge slopes: the height changes by (hb - ha) / width per column, split
+    // evenly around a center that moves by (cb - ca) / width
+    int a_height = q.ab - q.at;
+    int b_height = q.bb - q.bt;
+    int y_center_a = q.ab - (a_height / 2);
+    int y_center_b = q.bb - (b_height / 2);
+    int64_t dc = 2 * (int64_t)(y_center_b - y_center_a);
+    int64_t dh = (int64_t)b_height - a_height;
+    int64_t step_t = ((dc - dh) * 65536) / (2 * width);
+    int64_t step_b = ((dc + dh) * 65536) / (2 * width);
+
+    // only visit on-screen columns
+    int x_start = q.ax < 0 ? 0 : q.ax;
+    int x_end = q.bx > (int)scrnw ? (int)scrnw : q.bx;
+
+    int64_t i = x_start - q.ax + 1;
+    int64_t yt = ((int64_t)q.at << 16) + i * step_t;
+    int64_t yb = ((int64_t)q.ab << 16) + i * step_b;
+
+    for (int x = x_start; x < x_end; x++, yt += step_t, yb += step_b)
     {
-        if (x < 0 || x > scrnw-1) continue;
-
-        double dh = delta_height * i;
-        double dy_player_elev = delta_elevation * i;
+        int y1 = R_CapToScreenH(R_FixedToInt(yt));
+        int y2 = R_CapToScreenH(R_FixedToInt(yb));
 
-        int y1 = q.at - (dh / 2) + dy_player_elev;
-        int y2 = q.ab + (dh / 2) + dy_player_elev;
+        R_LutWrite(ceil_lut, x, y1, is_back_wall);
+        R_LutWrite(floor_lut, x, y2, is_back_wall);
 
-        y1 = R_CapToScreenH(y1);
-        y2 = R_CapToScreenH(y2);
+        if (is_back_wall || !draw_wall)
+            continue;
 
-        if (ceil_floor_wall == IS_CEIL)
-        {
-            // save the ceiling Y coordinates for each X coordinate
-            if (!is_back_wall)
-                xy_lut->t[x] = y1;
-            else
-                xy_lut->b[x] = y1;
-        }
-        else if (ceil_floor_wall == IS_FLOOR)
-        {
-            // save the floor's Y coordinates for each X coordinate
-            if (!is_back_wall)
-                xy_lut->t[x] = y2;
-            else
-                xy_lut->b[x] = y2;
-        }
-        else 
-        {
-            // rasterize
-            R_DrawLine(x, y1, x, y2, color);
-        }
+        // front-to-back draws walls after the caps
+        if (is_occluding)
+            wall_spans[num_wall_spans++] = (wall_span_t){x, y1, y2};
+        else
+            R_DrawVSpan(x, y1, y2, color);
     }
 }
 
@@ -309,6 +884,20 @@ double R_DistanceToPoint(vec2_t a, vec2_t b)
     );
 }
 
+int R_CompareSectorDist(const void *a, const void *b)
+{
+    int ia = *(const int *)a, ib = *(const int *)b;
+    double da = sectors_queue.sectors[ia].dist;
+    double db = sectors_queue.sectors[ib].dist;
+
+    // farthest first. qsort is not stable, so sectors at the same distance
+    // go by handle or they could swap places from one frame to the next
+    if (da != db)
+        return (da < db) - (da > db);
+
+    return (ia > ib) - (ia < ib);
+}
+
 void R_SortSectorsByDistToPlayer(vec2_t player_pos)
 {
     // calc sector distances
@@ -318,19 +907,52 @@ void R_SortSectorsByDistToPlayer(vec2_t player_pos)
         sectors_queue.sectors[i].dist = R_DistanceToPoint(centroid, player_pos);
     }
 
-    // sort sectors by distance to player
-    for (int i = 0; i < sectors_queue.num_sectors - 1; i++)
+    // sort handles, the sectors themselves never move
+    qsort(sectors_queue.order, sectors_queue.num_sectors, sizeof(int), R_CompareSectorDist);
+}
+
+// true if every column a sector's quads span is covered already
+bool R_IsOccluded(rquad_t *quads, int num_quads)
+{
+    int x_min = scrnw, x_max = -1;
+    for (int k = 0; k < num_quads; k++)
+    {
+        int a = quads[k].ax < quads[k].bx ? quads[k].ax : quads[k].bx;
+        int b = quads[k].ax < quads[k].bx ? quads[k].bx : quads[k].ax;
+        if (a < x_min) x_min = a;
+        if (b > x_max) x_max = b;
+    }
+
+    if (x_min < 0) x_min = 0;
+    if (x_max > (int)scrnw - 1) x_max = scrnw - 1;
+
+    for (int x = x_min; x <= x_max; x++)
     {
-        for (int j = 0; j < sectors_queue.num_sectors - i - 1; j++)
+        if (col_top[x] <= col_bot[x])
+            return false;
+    }
+
+    return true;
+}
+
+// clear the screen and the buffers of the current mode
+void R_BeginFrame()
+{
+    R_ClearScreenBuffer();
+    memset(&render_stats, 0, sizeof(render_stats));
+
+    if (is_occluding)
+    {
+        memset(coverage, 0, scrnw * scrnh);
+        for (int x = 0; x < (int)scrnw; x++)
         {
-            if (sectors_queue.sectors[j].dist < sectors_queue.sectors[j+1].dist)
-            {
-                sector_t s = sectors_queue.sectors[j];
-                sectors_queue.sectors[j] = sectors_queue.sectors[j + 1];
-                sectors_queue.sectors[j + 1] = s;
-            }
+            col_top[x] = 0;
+            col_bot[x] = scrnh - 1;
         }
     }
+
+    if (is_counting_overdraw)
+        memset(overdraw, 0, scrnw * scrnh);
 }
 
 void R_RenderSectors(player_t *player, game_state_t *game_state)
@@ -340,50 +962,45 @@ void R_RenderSectors(player_t *player, game_state_t *game_state)
     double fov = 300;
     unsigned int wall_color = 0xFFFF00FF;
 
-    // clear screen
-    R_ClearScreenBuffer();
+    R_BeginFrame();
 
     // sort polygons prior processing
     R_SortSectorsByDistToPlayer(player->position);
 
-    // lopp sectors
+    R_TransformVertices(player);
+
+    // enough scratch for every sector to be visible
+    R_ArenaReset(&frame_arena, sectors_queue.num_sectors * sizeof(sector_luts_t));
+
+    // lopp sectors, nearest first when occluding
     for (int i = 0; i < sectors_queue.num_sectors; i++)
     {
-        sector_t *s = &sectors_queue.sectors[i];
+        int n = is_occluding ? sectors_queue.num_sectors - 1 - i : i;
+        sector_t *s = &sectors_queue.sectors[sectors_queue.order[n]];
         int sector_h = s->height;
         int sector_e = s->elevation;
         int sector_clr = s->color;
 
-        for (int i = 0; i < 1024; i++)
-        {
-            s->ceilx_ylut.t[i] = 0;
-            s->ceilx_ylut.b[i] = 0;
-            s->floorx_ylut.t[i] = 0;
-            s->floorx_ylut.b[i] = 0;
-            s->portals_ceilx_ylut.t[i] = 0;
-            s->portals_ceilx_ylut.b[i] = 0;
-            s->portals_floorx_ylut.t[i] = 0;
-            s->portals_floorx_ylut.b[i] = 0;
-        }
+        // allocated with the first wall in front of the player
+        sector_luts_t *l = NULL;
+
+        // projected wall quads and the LUTs their caps go to
+        rquad_t quads[20];
+        plane_lut_t *ceil_luts[20];
+        plane_lut_t *floor_luts[20];
+        bool draw_walls[20];
+        int num_quads = 0;
 
         // loop walls
         for (int k = 0; k < s->num_walls; k++)
         {
             wall_t *w = &s->walls[k];
 
-            // displace the world based on player's position
-            double dx1 = w->a.x - player->position.x;
-            double dy1 = w->a.y - player->position.y;
-            double dx2 = w->b.x - player->position.x;
-            double dy2 = w->b.y - player->position.y;
-
-            // rotate the world around the player
-            double SN = sin(player->dir_angle);
-            double CN = cos(player->dir_angle);
-            double wx1 = dx1 * SN - dy1 * CN;
-            double wz1 = dx1 * CN + dy1 * SN;
-            double wx2 = dx2 * SN - dy2 * CN;
-            double wz2 = dx2 * CN + dy2 * SN;
+            // endpoints were moved to view space by R_TransformVertices
+            double wx1 = vertex_pool.vx[w->va];
+            double wz1 = vertex_pool.vz[w->va];
+            double wx2 = vertex_pool.vx[w->vb];
+            double wz2 = vertex_pool.vz[w->vb];
 
             // if z1 & z2 < 0 (wall completely behind player) -- skip it!
             // if z1 or z2 is behind the player -> clip it!
@@ -394,6 +1011,15 @@ void R_RenderSectors(player_t *player, game_state_t *game_state)
             else if (wz2 < 0)
                 R_ClipBehindPlayer(&wx2, &wz2, wx1, wz1);
 
+            if (l == NULL)
+            {
+                l = R_ArenaAlloc(&frame_arena, sizeof(sector_luts_t));
+                if (l == NULL)
+                    break;
+
+                R_LutBeginSector(l);
+            }
+
             // calc wall height based on distance
             double wh1 = (sector_h / wz1) * fov;
             double wh2 = (sector_h / wz2) * fov;
@@ -451,59 +1077,163 @@ void R_RenderSectors(player_t *player, game_state_t *game_state)
                 // bottom
                 rquad_t qb = R_CreateRendarableQuad(sx1, sx2, sy1 - pbh1, sy1, sy2 - pbh2, sy2);
 
-                R_Rasterize(qt, sector_clr, IS_CEIL, &s->portals_ceilx_ylut);
-                R_Rasterize(qt, sector_clr, IS_FLOOR, &s->portals_floorx_ylut);
-                R_Rasterize(qt, sector_clr, IS_WALL, NULL);
+                quads[num_quads] = qt;
+                ceil_luts[num_quads] = &l->portals_ceilx_ylut;
+                floor_luts[num_quads] = &l->portals_floorx_ylut;
+                draw_walls[num_quads++] = true;
 
-                R_Rasterize(qb, sector_clr, IS_CEIL, &s->ceilx_ylut);
-                R_Rasterize(qb, sector_clr, IS_FLOOR, &s->floorx_ylut);
-                R_Rasterize(qb, sector_clr, IS_WALL, NULL);
+                quads[num_quads] = qb;
+                ceil_luts[num_quads] = &l->ceilx_ylut;
+                floor_luts[num_quads] = &l->floorx_ylut;
+                draw_walls[num_quads++] = true;
             }
             else
             {
                 rquad_t q = R_CreateRendarableQuad(sx1, sx2, sy1 - wh1, sy1, sy2 - wh2, sy2);
-                R_Rasterize(q, sector_clr, IS_CEIL, &s->ceilx_ylut);
-                R_Rasterize(q, sector_clr, IS_FLOOR, &s->floorx_ylut);
-                R_Rasterize(q, sector_clr, IS_WALL, NULL);
+                quads[num_quads] = q;
+                ceil_luts[num_quads] = &l->ceilx_ylut;
+                floor_luts[num_quads] = &l->floorx_ylut;
+                draw_walls[num_quads++] = !w->is_buried;
+
+                if (w->is_buried)
+                    render_stats.walls_buried++;
             }
         }
 
+        // whole sector behind the player
+        if (l == NULL)
+            continue;
+
+        if (is_occluding && R_IsOccluded(quads, num_quads))
+        {
+            render_stats.sectors_skipped++;
+            continue;
+        }
+
+        render_stats.sectors_drawn++;
+        R_Record(RC_SECTOR, sector_clr, s->id, sectors_queue.order[n], 0, 0, 0, 0);
+
+        // the painter's path lets caps overdraw the walls, front-to-back
+        // keeps that by queueing the wall spans until the caps are drawn
+        num_wall_spans = 0;
+        for (int k = 0; k < num_quads; k++)
+            R_RasterizeQuad(quads[k], sector_clr, ceil_luts[k], floor_luts[k], draw_walls[k]);
+
+        // columns touched by any of the sector's LUTs
+        int x_min = l->ceilx_ylut.x_min;
+        int x_max = l->ceilx_ylut.x_max;
+        plane_lut_t *luts[3] = {&l->floorx_ylut, &l->portals_ceilx_ylut, &l->portals_floorx_ylut};
+        for (int k = 0; k < 3; k++)
+        {
+            if (luts[k]->x_min < x_min) x_min = luts[k]->x_min;
+            if (luts[k]->x_max > x_max) x_max = luts[k]->x_max;
+        }
+
+        if (x_min < 1)
+            x_min = 1;
+
         // rasterize sector's ceil & floor
-        for (int x = 1; x < 1024; x++)
+        for (int x = x_min; x <= x_max; x++)
         {
             // walls
-            int cy1 = s->ceilx_ylut.t[x];
-            int cy2 = s->ceilx_ylut.b[x];
-            int fy1 = s->floorx_ylut.t[x];
-            int fy2 = s->floorx_ylut.b[x];
+            int cy1 = R_LutTop(&l->ceilx_ylut, x);
+            int cy2 = R_LutBottom(&l->ceilx_ylut, x);
+            int fy1 = R_LutTop(&l->floorx_ylut, x);
+            int fy2 = R_LutBottom(&l->floorx_ylut, x);
 
             // portals
-            int pcy1 = s->portals_ceilx_ylut.t[x];
-            int pcy2 = s->portals_ceilx_ylut.b[x];
-            int pfy1 = s->portals_floorx_ylut.t[x];
-            int pfy2 = s->portals_floorx_ylut.b[x];
+            int pcy1 = R_LutTop(&l->portals_ceilx_ylut, x);
+            int pcy2 = R_LutBottom(&l->portals_ceilx_ylut, x);
+            int pfy1 = R_LutTop(&l->portals_floorx_ylut, x);
+            int pfy2 = R_LutBottom(&l->portals_floorx_ylut, x);
 
             // rasterize walls ceil & floor
             if ((player->z > s->elevation + s->height) && (cy1 > cy2) && (cy1 != 0 && cy2 != 0))
-                R_DrawLine(x, cy1, x, cy2, s->ceil_clr);
+                R_DrawVSpan(x, cy1, cy2, s->ceil_clr);
 
             if ((player->z < s->elevation) && (fy1 < fy2) && (fy1 != 0 || fy2 != 0))
-                R_DrawLine(x, fy1, x, fy2, s->floor_clr);
+                R_DrawVSpan(x, fy1, fy2, s->floor_clr);
 
             // rasterize portals ceil & floor
             if (pcy1 > pcy2 && (pcy1 != 0 && pcy2 != 0))
-                R_DrawLine(x, pcy1, x, pcy2, s->ceil_clr);
+                R_DrawVSpan(x, pcy1, pcy2, s->ceil_clr);
 
             if (pfy1 < pfy2 && (pfy1 != 0 || pfy2 != 0))
-                R_DrawLine(x, pfy1, x, pfy2, s->floor_clr);
+                R_DrawVSpan(x, pfy1, pfy2, s->floor_clr);
         }
+
+        for (int k = 0; k < num_wall_spans; k++)
+            R_DrawVSpan(wall_spans[k].x, wall_spans[k].y1, wall_spans[k].y2, sector_clr);
     }
 }
 
+// replace the frame by a heat map of how often each pixel was written
+// and put the numbers into the window title
+void R_DrawOverdraw(game_state_t *game_state)
+{
+    // ABGR: black, blue, green, yellow, red
+    static const unsigned int heat[5] = {
+        0xFF000000, 0xFFFF0000, 0xFF00FF00, 0xFF00FFFF, 0xFF0000FF
+    };
+
+    long covered = 0;
+    for (int i = 0; i < (int)(scrnw * scrnh); i++)
+    {
+        covered += overdraw[i] != 0;
+        screen_buffer[i] = heat[overdraw[i] < 4 ? overdraw[i] : 4];
+    }
+
+    char title[128];
+    snprintf(title, sizeof(title), "%s: %d sectors, %d occluded, %d buried walls, %ld px, overdraw %.2fx",
+             game_state->is_front_to_back ? "front-to-back" : "painter's",
+             render_stats.sectors_drawn, render_stats.sectors_skipped, render_stats.walls_buried,
+             render_stats.pixels_written,
+             covered ? (double)render_stats.pixels_written / covered : 0.0);
+    SDL_SetWindowTitle(window, title);
+}
+
+// debug mode renders one frame into the recorder at full speed, then shows
+// it replayed up to the inspector's cursor until it is dropped
+void R_Inspect(player_t *player, game_state_t *game_state)
+{
+    if (!R_RecorderHasFrame())
+    {
+        R_RecorderStart(is_occluding);
+        R_RenderSectors(player, game_state);
+        R_RecorderStop();
+    }
+
+    R_InspectorUpdate(game_state->delta_time);
+
+    is_occluding = R_RecorderIsOccluding();
+    is_counting_overdraw = false;
+    R_BeginFrame();
+    R_InspectorReplay();
+
+    is_occluding = false;
+    R_InspectorDrawOverlay(scrnw, scrnh);
+    R_InspectorTitle(window);
+}
+
 void R_Render(player_t *player, game_state_t *game_state)
 {
     is_debug_mode = game_state->is_debug_mode;
+    is_occluding = game_state->is_front_to_back;
+    is_counting_overdraw = game_state->is_overdraw_view;
+
+    if (is_debug_mode)
+    {
+        R_Inspect(player, game_state);
+        R_UpdateScreen();
+        return;
+    }
+
+    R_RecorderDrop();
     R_RenderSectors(player, game_state);
+
+    if (is_counting_overdraw)
+        R_DrawOverdraw(game_state);
+
     R_UpdateScreen();
 }
 
@@ -528,10 +1258,74 @@ void R_SectorAddWall(sector_t *sector, wall_t vertices)
     sector->num_walls++;
 }
 
-void R_AddSectorToQueue(sector_t *sector)
+int R_AddSectorToQueue(sector_t *sector)
 {
-    sectors_queue.sectors[sectors_queue.num_sectors] = *sector;
+    if (sectors_queue.num_sectors == sectors_queue.capacity)
+    {
+        int capacity = sectors_queue.capacity ? sectors_queue.capacity * 2 : 16;
+        sector_t *sectors = realloc(sectors_queue.sectors, capacity * sizeof(sector_t));
+        int *order = realloc(sectors_queue.order, capacity * sizeof(int));
+
+        if (sectors != NULL)
+            sectors_queue.sectors = sectors;
+        if (order != NULL)
+            sectors_queue.order = order;
+
+        if (sectors == NULL || order == NULL)
+        {
+            printf("Error growing sectors queue!\n");
+            return -1;
+        }
+
+        sectors_queue.capacity = capacity;
+    }
+
+    int handle = sectors_queue.num_sectors;
+    sectors_queue.sectors[handle] = *sector;
+    sectors_queue.order[handle] = handle;
+
+    if (!R_InternSectorVertices(&sectors_queue.sectors[handle]))
+        return -1;
+
     sectors_queue.num_sectors++;
+    R_MeshAddSector(handle);
+
+    return handle;
+}
+
+// swap in new geometry for a sector, it keeps its handle and id. only its
+// own walls are interned, vertices no wall uses any more stay in the pool
+bool R_ReplaceSector(int handle, sector_t *sector)
+{
+    if (handle < 0 || handle >= sectors_queue.num_sectors)
+        return false;
+
+    sector_t replaced = *sector;
+    replaced.id = sectors_queue.sectors[handle].id;
+    if (!R_InternSectorVertices(&replaced))
+        return false;
+
+    R_MeshRemoveSector(handle);
+    sectors_queue.sectors[handle] = replaced;
+    R_MeshAddSector(handle);
+
+    return true;
+}
+
+// drop every sector from handle num_sectors on
+void R_TruncateSectors(int num_sectors)
+{
+    if (num_sectors < 0 || num_sectors >= sectors_queue.num_sectors)
+        return;
+
+    for (int i = num_sectors; i < sectors_queue.num_sectors; i++)
+        R_MeshRemoveSector(i);
+
+    sectors_queue.num_sectors = num_sectors;
+
+    // the sort order may still reference dropped handles
+    for (int i = 0; i < num_sectors; i++)
+        sectors_queue.order[i] = i;
 }
 
 wall_t R_CreateWall(int ax, int ay, int bx, int by)
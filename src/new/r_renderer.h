@@ -11,10 +11,17 @@
 #include "g_game_state.h"
 #include "u_utils.h"
 
+#define R_MAX_SCRNW 1024
+
+// an entry is only valid if its generation matches the one of the sector
+// being rendered, anything else reads as 0
 typedef struct _r_plane
 {
-    int t[1024];
-    int b[1024];
+    int t[R_MAX_SCRNW];
+    int b[R_MAX_SCRNW];
+    unsigned int t_gen[R_MAX_SCRNW];
+    unsigned int b_gen[R_MAX_SCRNW];
+    int x_min, x_max; // columns written this generation
 } plane_lut_t;
 
 typedef struct _wall
@@ -24,6 +31,8 @@ typedef struct _wall
     double portal_top_height;
     double portal_bot_height;
     bool is_portal;
+    int va, vb; // endpoints in the vertex pool, set when queued
+    bool is_buried; // solid and fully covered by the neighbour behind it
 } wall_t;
 
 typedef struct _sector
@@ -37,26 +46,93 @@ typedef struct _sector
     unsigned int color;
     unsigned int floor_clr;
     unsigned int ceil_clr;
+    int first_edge; // the sector's edge loop in the mesh, one edge per wall
+} sector_t;
 
+// per-frame scratch of a visible sector, lives in the frame arena
+typedef struct _sector_luts
+{
     plane_lut_t portals_floorx_ylut;
     plane_lut_t portals_ceilx_ylut;
     plane_lut_t floorx_ylut;
     plane_lut_t ceilx_ylut;
-} sector_t;
+} sector_luts_t;
 
+// sectors are addressed by handle, the index into sectors[]
 typedef struct _sectors_queue
 {
-    sector_t sectors[1024];
+    sector_t *sectors;
+    int *order; // handles sorted by distance to the player, farthest first
     int num_sectors;
+    int capacity;
 } sectors_queue_t;
 
+typedef struct _render_stats
+{
+    int sectors_drawn;
+    int sectors_skipped; // fully occluded, front-to-back only
+    int walls_buried;    // skipped because a neighbour covers them
+    long pixels_written;
+} render_stats_t;
+
+// every distinct wall endpoint once, as SoA so a frame can move them all
+// to view space in one SIMD pass
+typedef struct _vertex_pool
+{
+    double *x;
+    double *y;
+    double *vx; // view space, x to the side
+    double *vz; // view space, depth
+    int num_vertices;
+    int capacity;
+
+    // open addressing index from position to vertex, -1 is empty
+    int *table;
+    int table_size;
+} vertex_pool_t;
+
+// half-edge mesh over the queued sectors. a wall shared by two sectors is
+// a pair of twin edges running in opposite directions
+typedef struct _half_edge
+{
+    int v;      // start vertex in the vertex pool
+    int next;   // next edge of the sector's loop
+    int twin;   // the neighbour's edge on the same wall, -1 if none
+    int sector; // handle of the owning sector
+    int wall;   // index into the sector's walls
+} half_edge_t;
+
+typedef struct _mesh
+{
+    half_edge_t *edges;
+    int num_edges;
+    int capacity;
+
+    // open addressing index from directed edge to edge, -1 is empty
+    int *table;
+    int table_size;
+} mesh_t;
+
+// bump allocator reset at the start of every frame
+typedef struct _arena
+{
+    unsigned char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
 void R_Init(SDL_Window *main_win, game_state_t *game_state);
 void R_Shutdown();
 void R_Render(player_t *player, game_state_t *game_state);
 void R_DrawWalls(player_t *player, game_state_t *game_state);
+void R_DrawVSpan(int x, int y0, int y1, unsigned int color);
+void R_DrawHSpan(int y, int x0, int x1, unsigned int color);
+void R_DrawLine(int x0, int y0, int x1, int y1, unsigned int color);
 sector_t R_CreateSector(int height, int elevation, unsigned int color, unsigned int ceil_clr, unsigned int floor_clr);
 void R_SectorAddWall(sector_t *sector, wall_t vertices);
-void R_AddSectorToQueue(sector_t *sector);
+int R_AddSectorToQueue(sector_t *sector);
+bool R_ReplaceSector(int handle, sector_t *sector);
+void R_TruncateSectors(int num_sectors);
 wall_t R_CreateWall(int ax, int ay, int bx, int by);
 wall_t R_CreatePortal(int ax, int ay, int bx, int by, int th, int bh);
 